@@ -0,0 +1,241 @@
+/* замеры fm: main.c подключается целиком, его main() отключён */
+#define FM_NO_MAIN
+#include "../main.c"
+
+#include <ftw.h>
+
+/* fm_bench [-r повторов] [-j потоков] каталог...
+Для каждого каталога замеряет фазы и печатает по строке JSON на фазу:
+  get_files        - чтение каталога, stat и сортировка (как при входе в каталог)
+  sort             - только сортировка уже прочитанного списка
+  format           - форматирование строк таблицы (format_row)
+  display_full     - полная перерисовка экрана (display_in_terminal)
+  display_scroll   - прокрутка списка на строку
+  dump             - рекурсивный вывод в файл (/dev/null)
+  dump_parallel    - то же в -j потоков, если -j больше 1
+Время - лучшее из повторов, страницы каталогов уже в кэше. peak_rss_kb -
+пиковый размер процесса на момент конца фазы, arena_peak_kb - пик арен
+списков (терминала и вывода в файл) */
+
+#define BENCH_ROWS 50
+#define BENCH_COLS 200
+
+int bench_runs = 3;
+long tree_entries;
+
+
+long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+/* строка результата; unit - за что считаем время: запись или кадр */
+void report(const char *dir, const char *phase, const char *unit, long count, long long best_ns)
+{
+    double per_unit = count > 0 ? (double)best_ns / count : 0;
+    double per_second = best_ns > 0 ? count * 1e9 / best_ns : 0;
+
+    /* путь - произвольные байты, экранируем как имена в --format=ndjson */
+    struct out_buf escaped = { NULL, 0, 0, -1 };
+    out_json_bytes(&escaped, dir, strlen(dir));
+    out_write(&escaped, "", 1);
+
+    printf("{\"dir\":\"%s\",\"phase\":\"%s\",\"unit\":\"%s\",\"count\":%ld,\"runs\":%d,"
+           "\"best_ns\":%lld,\"ns_per_unit\":%.1f,\"units_per_sec\":%.0f,\"peak_rss_kb\":%ld,\"arena_peak_kb\":%zu}\n",
+           escaped.data != NULL ? escaped.data : "", phase, unit, count, bench_runs, best_ns, per_unit, per_second, peak_rss_kb(),
+           (arena_peak_bytes(&listing_arena) + arena_peak_bytes(&dump_arena)) / 1024);
+    fflush(stdout);
+    out_free(&escaped);
+}
+
+
+int count_entry(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf)
+{
+    (void)fpath; (void)sb; (void)typeflag;
+    if (ftwbuf->level > 0)  tree_entries++;
+    return 0;
+}
+
+
+/* pty нужен только ради размера окна, кадры уходят в /dev/null */
+int open_terminal()
+{
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1)  return -1;
+
+    int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+    if (slave == -1)  return -1;
+
+    struct winsize ws = { .ws_row = BENCH_ROWS, .ws_col = BENCH_COLS };
+    ioctl(slave, TIOCSWINSZ, &ws);
+    return slave;
+}
+
+
+void bench_directory(char *dir, int threads, int null_fd)
+{
+    long long best;
+
+    /* get_files: как при входе в каталог */
+    best = -1;
+    for (int run = 0; run < bench_runs; run++)
+    {
+        long long start = now_ns();
+        file_counter = get_files(dir, &listing_arena, &files, &order);
+        long long elapsed = now_ns() - start;
+        if (file_counter < 0)
+        {
+            fprintf(stderr, "Не удалось прочитать каталог %s\n", dir);
+            return;
+        }
+        if (best < 0 || elapsed < best)  best = elapsed;
+    }
+    report(dir, "get_files", "entry", file_counter, best);
+
+    best = -1;
+    for (int run = 0; run < bench_runs; run++)
+    {
+        long long start = now_ns();
+        sort(files, file_counter, &order, SORT_NAME);
+        long long elapsed = now_ns() - start;
+        if (best < 0 || elapsed < best)  best = elapsed;
+    }
+    report(dir, "sort", "entry", file_counter, best);
+
+    /* format: кэш имён пользователей уже прогрет первым проходом */
+    best = -1;
+    struct file_row row;
+    for (int run = 0; run < bench_runs; run++)
+    {
+        long long start = now_ns();
+        for (int i = 0; i < file_counter; i++)  format_row(&files[order[i]], &row);
+        long long elapsed = now_ns() - start;
+        if (best < 0 || elapsed < best)  best = elapsed;
+    }
+    report(dir, "format", "entry", file_counter, best);
+
+    /* кадры в терминал */
+    strcpy(path, dir);
+    int frames = 200;
+
+    best = -1;
+    for (int run = 0; run < bench_runs; run++)
+    {
+        long long start = now_ns();
+        for (int i = 0; i < frames; i++)
+        {
+            invalidate_frame();
+            invalidate_rows();
+            display_in_terminal(path);
+        }
+        long long elapsed = now_ns() - start;
+        if (best < 0 || elapsed < best)  best = elapsed;
+    }
+    report(dir, "display_full", "frame", frames, best);
+
+    best = -1;
+    for (int run = 0; run < bench_runs; run++)
+    {
+        cursor_pos = 0;
+        scroll_pos = 0;
+        invalidate_frame();
+        display_in_terminal(path);
+
+        long long start = now_ns();
+        for (int i = 0; i < frames; i++)
+        {
+            cursor_pos = (cursor_pos + 1 < file_counter) ? cursor_pos + 1 : 0;
+            if (cursor_pos >= scroll_pos + BENCH_ROWS - 3)  scroll_pos = cursor_pos - (BENCH_ROWS - 3) + 1;
+            if (cursor_pos < scroll_pos)  scroll_pos = cursor_pos;
+            display_in_terminal(path);
+        }
+        long long elapsed = now_ns() - start;
+        if (best < 0 || elapsed < best)  best = elapsed;
+    }
+    report(dir, "display_scroll", "frame", frames, best);
+
+    /* вывод в файл по всему дереву */
+    tree_entries = 0;
+    nftw(dir, count_entry, 64, FTW_PHYS);
+
+    dump_out.fd = null_fd;
+    scan_out = &dump_out;
+    for (int parallel = 0; parallel <= (threads > 1); parallel++)
+    {
+        best = -1;
+        for (int run = 0; run < bench_runs; run++)
+        {
+            int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (dir_fd == -1)  break;
+
+            long long start = now_ns();
+            if (parallel)  display_files_parallel(dir_fd, dir, file_columns, threads);
+            else           display_files_iterative(dir_fd, dir, file_columns);
+            out_flush(&dump_out);
+            long long elapsed = now_ns() - start;
+            if (best < 0 || elapsed < best)  best = elapsed;
+        }
+        report(dir, parallel ? "dump_parallel" : "dump", "entry", tree_entries, best);
+    }
+    scan_out = NULL;
+}
+
+
+int main(int argc, char *argv[])
+{
+    setlocale(LC_ALL, "");
+    utf8_locale = (strcmp(nl_langinfo(CODESET), "UTF-8") == 0);
+
+    int threads = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:j:u")) != -1)
+    {
+        switch (opt)
+        {
+            case 'r':  bench_runs = atoi(optarg);  break;
+            case 'j':  threads = atoi(optarg);     break;
+            case 'u':  scan_flags |= SCAN_STATX_BATCH;  break;
+            default:
+                fprintf(stderr, "Использование: %s [-r повторов] [-j потоков] [-u] каталог...\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind == argc || bench_runs < 1 || threads < 1)
+    {
+        fprintf(stderr, "Использование: %s [-r повторов] [-j потоков] [-u] каталог...\n", argv[0]);
+        return 1;
+    }
+
+    int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    terminal_fd = open_terminal();
+    if (null_fd == -1 || terminal_fd == -1)
+    {
+        fprintf(stderr, "Не удалось открыть /dev/null или pty\n");
+        return 1;
+    }
+    frame.fd = null_fd;
+
+    for (int i = optind; i < argc; i++)
+    {
+        char dir[PATH_MAX];
+        if (realpath(argv[i], dir) == NULL)
+        {
+            fprintf(stderr, "Нет каталога %s\n", argv[i]);
+            continue;
+        }
+        bench_directory(dir, threads, null_fd);
+    }
+
+    out_free(&frame);
+    out_free(&dump_out);
+    arena_free(&listing_arena);
+    arena_free(&dump_arena);
+    free(order);
+    id_cache_free(&owner_cache);
+    id_cache_free(&group_cache);
+    uring_free(&stat_ring);
+    return 0;
+}
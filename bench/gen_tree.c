@@ -0,0 +1,241 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+/* генератор синтетических деревьев для fm_bench.
+Дерево зависит только от вида, параметров и seed: имена, права и времена
+берутся из своего генератора случайных чисел, так что на любой машине
+получается то же самое и результаты замеров можно сравнивать */
+
+#define BASE_TIME 1600000000L  /* 13.09.2020 - от него отсчитываем mtime и atime */
+
+unsigned long long rng_state;
+
+
+/* xorshift64*: свой генератор, чтобы не зависеть от rand() libc */
+unsigned long long next_random()
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+
+/* права и времена объекта - тоже из генератора */
+int set_attributes(int dir_fd, const char *name, int is_dir)
+{
+    mode_t modes[] = { 0644, 0600, 0755, 0444, 0640 };
+    mode_t mode = is_dir ? 0755 : modes[next_random() % 5];
+    if (fchmodat(dir_fd, name, mode, 0) == -1)  return -1;
+
+    struct timespec times[2];
+    times[0].tv_sec = BASE_TIME + (long)(next_random() % (3L * 365 * 86400));  /* atime */
+    times[0].tv_nsec = 0;
+    times[1].tv_sec = BASE_TIME + (long)(next_random() % (3L * 365 * 86400));  /* mtime */
+    times[1].tv_nsec = 0;
+    return utimensat(dir_fd, name, times, AT_SYMLINK_NOFOLLOW);
+}
+
+
+int make_file(int dir_fd, const char *name)
+{
+    int fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        fprintf(stderr, "Не удалось создать файл %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+    close(fd);
+    return set_attributes(dir_fd, name, 0);
+}
+
+
+/* каталог name внутри dir_fd; возвращает его дескриптор */
+int make_dir(int dir_fd, const char *name)
+{
+    if (mkdirat(dir_fd, name, 0755) == -1 && errno != EEXIST)
+    {
+        fprintf(stderr, "Не удалось создать каталог %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+    return openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+
+/* плоский каталог: count файлов */
+int generate_flat(int dir_fd, long count)
+{
+    char name[32];
+    for (long i = 0; i < count; i++)
+    {
+        snprintf(name, sizeof(name), "file_%07ld", i);
+        if (make_file(dir_fd, name) != 0)  return -1;
+    }
+    return 0;
+}
+
+
+/* цепочка из depth вложенных каталогов, в каждом по files файлов */
+int generate_deep(int dir_fd, long depth, long files)
+{
+    int fd = dup(dir_fd);
+    char name[32];
+    for (long level = 0; level < depth && fd != -1; level++)
+    {
+        for (long i = 0; i < files; i++)
+        {
+            snprintf(name, sizeof(name), "f%ld", i);
+            if (make_file(fd, name) != 0)
+            {
+                close(fd);
+                return -1;
+            }
+        }
+
+        snprintf(name, sizeof(name), "d%05ld", level);
+        int child = make_dir(fd, name);
+        close(fd);
+        fd = child;
+    }
+    if (fd == -1)  return -1;
+    close(fd);
+
+    /* атрибуты каталогов - вторым проходом, когда их содержимое уже не меняется */
+    fd = dup(dir_fd);
+    for (long level = 0; level < depth && fd != -1; level++)
+    {
+        snprintf(name, sizeof(name), "d%05ld", level);
+        set_attributes(fd, name, 1);
+        int child = openat(fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        close(fd);
+        fd = child;
+    }
+    if (fd != -1)  close(fd);
+    return 0;
+}
+
+
+/* дерево глубины depth: в каждом каталоге fanout подкаталогов и fanout файлов */
+int generate_wide(int dir_fd, long fanout, long depth)
+{
+    char name[32];
+    for (long i = 0; i < fanout; i++)
+    {
+        snprintf(name, sizeof(name), "file_%03ld", i);
+        if (make_file(dir_fd, name) != 0)  return -1;
+    }
+    if (depth == 0)  return 0;
+
+    for (long i = 0; i < fanout; i++)
+    {
+        snprintf(name, sizeof(name), "dir_%03ld", i);
+        int child = make_dir(dir_fd, name);
+        if (child == -1)  return -1;
+        int result = generate_wide(child, fanout, depth - 1);
+        close(child);
+        if (result != 0)  return -1;
+        set_attributes(dir_fd, name, 1);
+    }
+    return 0;
+}
+
+
+/* count файлов с длинными именами в UTF-8: кириллица, греческий,
+японский и эмодзи, до 250 байт (NAME_MAX = 255) */
+int generate_utf8(int dir_fd, long count)
+{
+    const char *syllables[] = { "ё", "жи", "щу", "фа", "ъ", "λ", "ω", "Ψ", "日", "本", "語", "の", "🙂", "🌲", "a", "_" };
+    char name[256];
+    for (long i = 0; i < count; i++)
+    {
+        /* уникальность даёт номер в начале имени */
+        int length = snprintf(name, sizeof(name), "%07ld_", i);
+        long limit = 40 + (long)(next_random() % 200);
+        while (1)
+        {
+            const char *syllable = syllables[next_random() % 16];
+            size_t size = strlen(syllable);
+            if (length + size > (size_t)limit)  break;
+            memcpy(name + length, syllable, size);
+            length += size;
+        }
+        name[length] = 0;
+        if (make_file(dir_fd, name) != 0)  return -1;
+    }
+    return 0;
+}
+
+
+void usage(const char *program)
+{
+    fprintf(stderr,
+            "Использование: %s вид каталог [параметры] [-s seed]\n"
+            "  flat  каталог [N=1000000]          - N файлов в одном каталоге\n"
+            "  deep  каталог [глубина=1000] [файлов=4] - цепочка вложенных каталогов\n"
+            "  wide  каталог [ветвление=10] [глубина=4] - широкое дерево\n"
+            "  utf8  каталог [N=10000]            - длинные имена в UTF-8\n",
+            program);
+}
+
+
+int main(int argc, char *argv[])
+{
+    rng_state = 0x9e3779b97f4a7c15ULL;
+
+    /* -s seed можно указать последним */
+    if (argc >= 3 && strcmp(argv[argc - 2], "-s") == 0)
+    {
+        rng_state ^= strtoull(argv[argc - 1], NULL, 10) * 0xbf58476d1ce4e5b9ULL;
+        if (rng_state == 0)  rng_state = 1;
+        argc -= 2;
+    }
+
+    if (argc < 3)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const char *kind = argv[1];
+    long first = (argc > 3) ? atol(argv[3]) : -1;
+    long second = (argc > 4) ? atol(argv[4]) : -1;
+
+    if (mkdir(argv[2], 0755) == -1 && errno != EEXIST)
+    {
+        fprintf(stderr, "Не удалось создать каталог %s: %s\n", argv[2], strerror(errno));
+        return 1;
+    }
+    int dir_fd = open(argv[2], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1)
+    {
+        fprintf(stderr, "Не удалось открыть каталог %s: %s\n", argv[2], strerror(errno));
+        return 1;
+    }
+
+    int result;
+    if (strcmp(kind, "flat") == 0)
+        result = generate_flat(dir_fd, first >= 0 ? first : 1000000);
+    else if (strcmp(kind, "deep") == 0)
+        result = generate_deep(dir_fd, first >= 0 ? first : 1000, second >= 0 ? second : 4);
+    else if (strcmp(kind, "wide") == 0)
+        result = generate_wide(dir_fd, first >= 0 ? first : 10, second >= 0 ? second : 4);
+    else if (strcmp(kind, "utf8") == 0)
+        result = generate_utf8(dir_fd, first >= 0 ? first : 10000);
+    else
+    {
+        usage(argv[0]);
+        result = 1;
+    }
+
+    close(dir_fd);
+    return result == 0 ? 0 : 1;
+}
@@ -1,1020 +1,7255 @@
+#define _GNU_SOURCE  /* struct statx, fstatat */
+
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <langinfo.h>
 #include <grp.h>
+#include <limits.h>
+#include <linux/io_uring.h>
 #include <locale.h>
+#include <pthread.h>
+#include <poll.h>
+#include <stdarg.h>
 #include <pwd.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 #include <wchar.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /* ограничения по размеру для полей file_info */
 #define PERM_MAX 11
 #define TYPE_MAX 17
 #define TIME_MAX 18
 #define ID_MAX   30
+#define BYTES_MAX 12
+
+/* известен ли размер записи (file_info.total); у каталога - сумма по поддереву */
+#define DU_UNKNOWN  0
+#define DU_PARTIAL  1  /* подсчёт идёт, показываем то, что уже сложено */
+#define DU_COMPLETE 2
+#define DU_QUEUED   3  /* каталог уже поставлен в подсчёт, но сумма ещё неизвестна */
+
+/* столбцы таблицы в терминале; в файл выводятся первые 7, без size */
+#define TABLE_COLUMNS 8
 
 /* размеры колонок для записи в файл */
 unsigned int file_columns[7] = {57, 19, 19, 19, 19, 19, 19};
 
 struct file_info *files = NULL;
+unsigned int *order = NULL;  /* порядок вывода files после сортировки */
 int file_counter = 0;
 char path[PATH_MAX];
 int cursor_pos = 0;
 int scroll_pos = 0;
 int path_scroll = 0;
 int active_column = 0;
-int column_scrolls[7];
+int column_scrolls[TABLE_COLUMNS];
 unsigned int rows;
 
-/* структура для хранения информации
-об объекте файловой системы */
-struct file_info
+
+/* статистика (--stats): счётчики и время по фазам, общие для всех потоков */
+
+enum stat_counter
 {
-    char name[NAME_MAX];
-    char type[TYPE_MAX];
-    char uid[ID_MAX];
-    char gid[ID_MAX];
-    char permissions[PERM_MAX];
-    char mtime[TIME_MAX];
-    char atime[TIME_MAX];
-    char real_name[NAME_MAX];
+    STAT_DIRS,       /* прочитанных каталогов */
+    STAT_ENTRIES,    /* прочитанных записей */
+    STAT_READDIR,    /* вызовов readdir */
+    STAT_STAT,       /* fstatat */
+    STAT_STATX,      /* statx через io_uring */
+    STAT_NSS,        /* запросов getpwuid/getgrgid мимо кэша */
+    STAT_OPEN,       /* открытий каталогов */
+    STAT_REUSED,     /* каталогов, взятых из предыдущего снимка без чтения */
+    STAT_WRITES,     /* write */
+    STAT_BYTES,      /* записано байт */
+    STAT_COUNTERS
 };
 
+enum stat_phase
+{
+    PHASE_READDIR,
+    PHASE_STAT,
+    PHASE_NSS,
+    PHASE_SORT,
+    PHASE_FORMAT,
+    PHASE_OUTPUT,
+    STAT_PHASES
+};
 
-/* лексикографическая сортировка */
-int compare(struct file_info *file_1, struct file_info *file_2)
+struct stats
 {
-    int is_dir1 = (strcmp(file_1->type, "directory") == 0);
-    int is_dir2 = (strcmp(file_2->type, "directory") == 0);
+    unsigned long long counters[STAT_COUNTERS];
+    unsigned long long phase_ns[STAT_PHASES];
+    unsigned long long start_ns;
+};
 
-    if (is_dir1 && !is_dir2)  return -1;                  /* если 1 - dir, а 2 - нет => 1 выводим первым */
-    if (!is_dir1 && is_dir2)  return 1;                   /* если 2 - dir, а 1 - нет => 2 выводим первым */
-    return strcmp(file_1->real_name, file_2->real_name);  /* если оба dir => сравниваем по имени */
-}
+int stats_enabled = 0;
+struct stats stats;
 
 
-void sort(struct file_info *files)
+unsigned long long monotonic_ns()
 {
-    if (files == NULL || file_counter == 0)  return;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-    for (unsigned int i = 0; i < file_counter; i++)
-    {
-        for (unsigned int j = 0; j < file_counter - i - 1; j++)
-        {
-            if (compare(&files[j], &files[j + 1]) > 0)
-            {
-                struct file_info tmp = files[j];
-                files[j] = files[j + 1];
-                files[j + 1] = tmp;
-            }
-        }
-    }
+
+void stats_add(enum stat_counter counter, unsigned long long value)
+{
+    if (stats_enabled)  __atomic_add_fetch(&stats.counters[counter], value, __ATOMIC_RELAXED);
 }
 
 
-/* экранирование символов '<' и '>' */
-void add_backslash(char *name)
+/* начало замера фазы; 0, если статистика выключена */
+unsigned long long stats_begin()
 {
-    char tmp[NAME_MAX];
-    unsigned int j = 0;
-    for (unsigned int i = 0; name[i] != 0; i++)
-    {
-        if (name[i] == '<' || name[i] == '>')
-        {
-            tmp[j++] = '\\';
-            tmp[j++] = name[i];
-        }
-        else
-        {
-            tmp[j++] = name[i];
-        }
-    }
-    tmp[j] = 0;
-    strcpy(name, tmp);
+    return stats_enabled ? monotonic_ns() : 0;
 }
 
 
-/* получаем имя */
-void get_name(struct dirent *rd, char *name)
+void stats_end(enum stat_phase phase, unsigned long long start)
 {
-    strcpy(name, rd->d_name);
-    add_backslash(name);
+    if (stats_enabled)  __atomic_add_fetch(&stats.phase_ns[phase], monotonic_ns() - start, __ATOMIC_RELAXED);
 }
 
 
-/* получаем тип объекта файловой системы*/
-void get_type(struct stat st, char *type)
+void stats_reset()
 {
-    switch (st.st_mode & S_IFMT)
-    {
-        case S_IFBLK:   strcpy(type, "block device");       break;
-        case S_IFCHR:   strcpy(type, "character device");   break;
-        case S_IFDIR:   strcpy(type, "directory");          break;
-        case S_IFIFO:   strcpy(type, "FIFO");               break;
-        case S_IFLNK:   strcpy(type, "symlink");            break;
-        case S_IFREG:   strcpy(type, "regular file");       break;
-        case S_IFSOCK:  strcpy(type, "socket");             break;
-        default:        strcpy(type, "unknown");            break;
-    }
+    memset(&stats, 0, sizeof(stats));
+    stats.start_ns = monotonic_ns();
 }
 
-/* получаем имя владельца */
-int get_owner(struct stat st, char *uid)
+
+/* трасса (--trace) в формате Chrome trace: у каждого потока своё растущее кольцо
+событий без блокировок, кольца выводятся в файл при выходе */
+
+#define TRACE_RING_SIZE (1 << 16)
+#define TRACE_RING_MIN  64
+#define TRACE_DETAIL    48
+
+struct trace_event
+{
+    const char *name;
+    unsigned long long start_ns;
+    unsigned long long duration_ns;
+    char detail[TRACE_DETAIL];  /* путь, число записей; у длинных путей - хвост */
+};
+
+struct trace_ring
+{
+    struct trace_ring *next;
+    pid_t tid;
+    char thread_name[16];
+    int unused;                  /* поток завершился, не записав событий */
+    unsigned long long written;  /* всего событий; в кольце - последние capacity */
+    unsigned int capacity;       /* растёт до TRACE_RING_SIZE, пока кольцо не переполнилось */
+    struct trace_event *events;
+};
+
+char *trace_path = NULL;                  /* NULL - трасса выключена; путь абсолютный */
+unsigned long long trace_start_ns;
+struct trace_ring *trace_rings = NULL;    /* все кольца, пополняется без блокировки */
+__thread struct trace_ring *trace_local = NULL;
+
+
+/* кольцо текущего потока, создаётся при первом событии */
+struct trace_ring *trace_ring()
 {
-    struct passwd *pw = getpwuid(st.st_uid);
-    if (pw == NULL)
+    if (trace_local != NULL)  return trace_local;
+
+    /* сначала - пустое кольцо завершившегося потока */
+    struct trace_ring *ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE);
+    while (ring != NULL && !(__atomic_load_n(&ring->unused, __ATOMIC_RELAXED)
+                             && __atomic_exchange_n(&ring->unused, 0, __ATOMIC_ACQUIRE)))
     {
-        wprintf(L"\e[%d;1HНе удалось получить pw.", rows);
-        fflush(stdout);
-        return -2;
+        ring = ring->next;
     }
-    strcpy(uid, pw->pw_name);
-    return 0;
-}
 
-/* получаем имя группы */
-int get_group(struct stat st, char *gid)
-{
-    struct group *gr = getgrgid(st.st_gid);
-    if (gr == NULL)
+    if (ring == NULL)
     {
-        wprintf(L"\e[%d;1HНе удалось получить gr.", rows);
-        fflush(stdout);
-        return -3;
+        ring = malloc(sizeof(struct trace_ring));
+        if (ring == NULL)  return NULL;
+        ring->unused = 0;
+        ring->written = 0;
+        ring->capacity = TRACE_RING_MIN;
+        ring->events = malloc(ring->capacity * sizeof(struct trace_event));
+        if (ring->events == NULL)
+        {
+            free(ring);
+            return NULL;
+        }
+
+        ring->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&trace_rings, &ring->next, ring, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
     }
-    strcpy(gid, gr->gr_name);
-    return 0;
+    ring->tid = gettid();
+    ring->thread_name[0] = 0;
+
+    trace_local = ring;
+    return ring;
 }
 
-/* получаем права доступа */
-void get_permissions(struct stat st, char *permissions)
+
+/* конец потока: кольцо без событий отдаём следующему потоку */
+void trace_thread_end()
 {
-    strcpy(permissions, "----------");
+    struct trace_ring *ring = trace_local;
+    trace_local = NULL;
+    if (ring != NULL && ring->written == 0)  __atomic_store_n(&ring->unused, 1, __ATOMIC_RELEASE);
+}
 
-    /* первый символ */
-    if (S_ISDIR(st.st_mode))       permissions[0] = 'd';
-    else if (S_ISFIFO(st.st_mode)) permissions[0] = 'p';
-    else if (S_ISLNK(st.st_mode))  permissions[0] = 'l';
-    else if (S_ISBLK(st.st_mode))  permissions[0] = 'b';
-    else if (S_ISCHR(st.st_mode))  permissions[0] = 'c';
-    else if (S_ISSOCK(st.st_mode)) permissions[0] = 's';
 
-    /* rwxrwxrwx */
-    if (st.st_mode & S_IRUSR) permissions[1] = 'r';
-    if (st.st_mode & S_IWUSR) permissions[2] = 'w';
-    if (st.st_mode & S_IXUSR) permissions[3] = 'x';
-    if (st.st_mode & S_IRGRP) permissions[4] = 'r';
-    if (st.st_mode & S_IWGRP) permissions[5] = 'w';
-    if (st.st_mode & S_IXGRP) permissions[6] = 'x';
-    if (st.st_mode & S_IROTH) permissions[7] = 'r';
-    if (st.st_mode & S_IWOTH) permissions[8] = 'w';
-    if (st.st_mode & S_IXOTH) permissions[9] = 'x';
+void trace_thread_name(const char *name)
+{
+    if (trace_path == NULL)  return;
+    struct trace_ring *ring = trace_ring();
+    if (ring != NULL)  snprintf(ring->thread_name, sizeof(ring->thread_name), "%s", name);
 }
 
-/* получаем дату модификации */
-int get_mtime(struct stat st, char *mtime)
-{
-    struct tm *tmp = localtime(&st.st_mtime);
-    if (tmp == NULL)
-    {
-        wprintf(L"\e[%d;1HНе удалось получить localtime.", rows);
-        fflush(stdout);
-        return -4;
-    }
 
-    /* формат: 01.01.2000 12:30 */
-    strftime(mtime, TIME_MAX, "%d.%m.%Y  %H:%M", tmp);
-    return 0;
+/* начало события; 0, если трасса выключена */
+unsigned long long trace_begin()
+{
+    return (trace_path != NULL) ? monotonic_ns() : 0;
 }
 
-/* получаем дату доступа */
-int get_atime(struct stat st, char *atime)
+
+/* событие name от start до текущего момента; detail - printf-формат или NULL */
+void trace_end(const char *name, unsigned long long start, const char *format, ...)
 {
-    struct tm *tmp = localtime(&st.st_atime);
-    if (tmp == NULL)
+    if (trace_path == NULL)  return;
+    unsigned long long end = monotonic_ns();
+
+    struct trace_ring *ring = trace_ring();
+    if (ring == NULL)  return;
+    if (ring->written == ring->capacity && ring->capacity < TRACE_RING_SIZE)
     {
-        wprintf(L"\e[%d;1HНе удалось получить localtime.", rows);
-        fflush(stdout);
-        return -5;
+        /* без памяти на рост просто затираем старые события */
+        struct trace_event *events = realloc(ring->events, 2 * ring->capacity * sizeof(struct trace_event));
+        if (events != NULL)
+        {
+            ring->events = events;
+            ring->capacity *= 2;
+        }
     }
+    struct trace_event *event = &ring->events[ring->written++ % ring->capacity];
+    event->name = name;
+    event->start_ns = start;
+    event->duration_ns = end - start;
+    event->detail[0] = 0;
 
-    /* формат: 01.01.2000 12:30 */
-    strftime(atime, TIME_MAX, "%d.%m.%Y  %H:%M", tmp);
-    return 0;
+    if (format != NULL)
+    {
+        char detail[PATH_MAX];
+        va_list args;
+        va_start(args, format);
+        vsnprintf(detail, sizeof(detail), format, args);
+        va_end(args);
+
+        /* из длинного пути интереснее конец; многобайтовый символ не разрезаем */
+        size_t length = strlen(detail);
+        size_t skip = (length < TRACE_DETAIL) ? 0 : length - (TRACE_DETAIL - 4);
+        while (skip > 0 && ((unsigned char)detail[skip] & 0xc0) == 0x80)  skip++;
+        char *tail = event->detail;
+        if (skip > 0)
+        {
+            memcpy(tail, "...", 3);
+            tail += 3;
+        }
+        memcpy(tail, detail + skip, length - skip + 1);
+    }
 }
 
-/* получаем список и кол-во объектов в каталоге */
-int get_files(char *path, struct file_info **files)
+
+void trace_json_string(FILE *file, const char *str)
 {
-    DIR *dir = opendir(path);
-    if (dir == NULL)
+    fputc('"', file);
+    for (; *str != 0; str++)
     {
-        wprintf(L"\e[%d;1HНе удалось открыть директорию.", rows);
-        fflush(stdout);
-        return -6;
+        unsigned char c = *str;
+        if (c == '"' || c == '\\')  fprintf(file, "\\%c", c);
+        else if (c < 0x20)          fprintf(file, "\\u%04x", c);
+        else                        fputc(c, file);
     }
+    fputc('"', file);
+}
 
-    /* если в files уже что-то есть */
-    if (*files != NULL) {
-        free(*files);
-        *files = NULL;
-    }
 
-    struct dirent *rd;
-    struct file_info *tmp = NULL;
-    int local_file_counter = 0;
+/* пишем все кольца в trace_path и освобождаем их. Вызывается, когда
+остальные потоки уже завершены */
+int trace_write()
+{
+    FILE *file = fopen(trace_path, "w");
+    int first = 1;
+    if (file != NULL)  fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", file);
 
-    while (1)
+    struct trace_ring *ring = trace_rings;
+    while (ring != NULL)
     {
-        rd = readdir(dir);
-        if (rd == NULL)
+        if (file != NULL && ring->thread_name[0] != 0 && !ring->unused)
         {
-            if (errno != 0)
+            fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":",
+                    first ? "" : ",", getpid(), ring->tid);
+            trace_json_string(file, ring->thread_name);
+            fputs("}}", file);
+            first = 0;
+        }
+
+        unsigned long long begin = (ring->written > ring->capacity) ? ring->written - ring->capacity : 0;
+        for (unsigned long long i = begin; file != NULL && i < ring->written; i++)
+        {
+            struct trace_event *event = &ring->events[i % ring->capacity];
+            fprintf(file, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                    first ? "" : ",", event->name, getpid(), ring->tid,
+                    (event->start_ns - trace_start_ns) / 1e3, event->duration_ns / 1e3);
+            if (event->detail[0] != 0)
             {
-                wprintf(L"\e[%d;1HНе удалось получить rd.", rows);
-                fflush(stdout);
-                closedir(dir);
-                return -7;
+                fputs(",\"args\":{\"detail\":", file);
+                trace_json_string(file, event->detail);
+                fputc('}', file);
             }
-            break;
+            fputc('}', file);
+            first = 0;
         }
 
-        /* пропускаем "." и ".." */
-        if (strcmp(rd->d_name, ".") == 0 || strcmp(rd->d_name, "..") == 0)
-            continue;
+        struct trace_ring *next = ring->next;
+        free(ring->events);
+        free(ring);
+        ring = next;
+    }
+    trace_rings = NULL;
+    trace_local = NULL;
 
-        tmp = realloc(*files, (local_file_counter + 1) * sizeof(struct file_info));
-        if (tmp == NULL)
-        {
-            wprintf(L"\e[%d;1HНе удалось выделить память для tmp.", rows);
-            fflush(stdout);
-            free(*files);
-            closedir(dir);
-            return -8;
-        }
-        *files = tmp;
+    if (file == NULL)  return -1;
+    fputs("\n]}\n", file);
+    return (fclose(file) == 0) ? 0 : -1;
+}
 
-        struct file_info *current_file = *files + local_file_counter;
 
-        /* name */
-        get_name(rd, current_file->name);
-        strcpy(current_file->real_name, rd->d_name);
+/* структура для хранения информации
+об объекте файловой системы: храним сырые поля stat,
+строки для колонок собираются только при выводе */
+struct file_info
+{
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    struct timespec mtim;
+    struct timespec atim;
+    unsigned long long size;    /* st_size, у каталога после подсчёта - сумма по поддереву */
+    unsigned long long blocks;  /* st_blocks, блоки по 512 байт */
+    unsigned char total;    /* известен ли size: DU_UNKNOWN, DU_QUEUED, DU_PARTIAL (каталог, подсчёт идёт), DU_COMPLETE */
+    unsigned char pending;  /* 1 - stat ещё не сделан, известны только имя и тип из d_type */
+    char real_name[NAME_MAX + 1];
+};
 
-        /* stat */
-        char full_path[PATH_MAX];
-        snprintf(full_path, PATH_MAX, "%s/%s", path, rd->d_name);
 
-        struct stat st;
-        if (stat(full_path, &st) == -1)
-        {
-            wprintf(L"\e[%d;1HНе удалось получить stat.", rows);
-            fflush(stdout);
-            continue;
-        }
+/* отформатированная строка таблицы */
+struct file_row
+{
+    char name[2 * NAME_MAX + 1];  /* с учётом экранирования каждого символа */
+    char type[TYPE_MAX];
+    char uid[ID_MAX];
+    char gid[ID_MAX];
+    char permissions[PERM_MAX];
+    char mtime[TIME_MAX];
+    char atime[TIME_MAX];
+    char size[BYTES_MAX];  /* только для терминала */
+};
 
-        /* type */
-        get_type(st, current_file->type);
 
-        /* owner */
-        if (get_owner(st, current_file->uid) != 0)
-        {
-            wprintf(L"\e[%d;1HНе удалось получить имя владельца.", rows);
-            fflush(stdout);
-            continue;
-        }
+/* кэш отформатированных строк для видимых в терминале записей:
+запись с индексом i лежит в ячейке i % ROW_CACHE_SIZE и действительна,
+пока не сменился список (listing_generation) */
+#define ROW_CACHE_SIZE 256
 
-        /* group */
-        if (get_group(st, current_file->gid) != 0)
-        {
-            wprintf(L"\e[%d;1HНе удалось получить имя группы.", rows);
-            fflush(stdout);
-            continue;
-        }
+struct row_cache_entry
+{
+    unsigned int index;
+    unsigned int generation;  /* 0 - ячейка пуста */
+    struct file_row row;
+};
 
-        /* permissions */
-        get_permissions(st, current_file->permissions);
+struct row_cache_entry row_cache[ROW_CACHE_SIZE];
+unsigned int listing_generation = 1;  /* меняется при любом изменении записей */
+unsigned int listing_id = 1;          /* меняется при переходе в другой каталог */
 
-        /* mtime */
-        if (get_mtime(st, current_file->mtime) != 0)
-        {
-            wprintf(L"\e[%d;1HНе удалось получить время изменения.", rows);
-            fflush(stdout);
-            continue;
-        }
 
-        /* atime */
-        if (get_atime(st, current_file->atime) != 0)
-        {
-            wprintf(L"\e[%d;1HНе удалось получить время доступа.", rows);
-            fflush(stdout);
-            continue;
-        }
+/* арена для списков файлов: записи лежат подряд, ёмкость растёт
+геометрически, память переиспользуется при переходах между каталогами
+и между уровнями рекурсии при выводе в файл */
+struct file_arena
+{
+    struct file_info *data;
+    unsigned int used;      /* занятые записи */
+    unsigned int capacity;  /* выделенные записи */
+    unsigned int peak;      /* максимум used за время работы */
+};
 
-        local_file_counter++;
-    }
+#define ARENA_MIN_CAPACITY 64
 
-    closedir(dir);
-    file_counter = local_file_counter;
-    sort(*files);
-    return local_file_counter;
-}
+struct file_arena listing_arena;  /* список для терминала */
+struct file_arena dump_arena;     /* стек списков для рекурсивного вывода */
 
 
-/* расчёт размера колонок */
-void count_columns_width(unsigned short x, unsigned int columns[])
+/* резервируем место под ещё одну запись: запись становится занятой
+только после arena_commit, как раньше счётчик увеличивался только после
+успешного заполнения */
+struct file_info *arena_reserve(struct file_arena *arena)
 {
-	/* чтобы таблица выглядела приятнее, делим на 10, а не 9 */
-    columns[0] = x * 3/10;
-    for (unsigned int i = 1; i < 7; i++)
+    if (arena->used == arena->capacity)
     {
-        columns[i] = x * 1/10;
+        unsigned int capacity = arena->capacity * 2;
+        if (capacity < ARENA_MIN_CAPACITY)  capacity = ARENA_MIN_CAPACITY;
+
+        struct file_info *tmp = realloc(arena->data, capacity * sizeof(struct file_info));
+        if (tmp == NULL)  return NULL;
+
+        arena->data = tmp;
+        arena->capacity = capacity;
     }
+    return arena->data + arena->used;
 }
 
 
-void print_path(char *path, struct winsize ws)
+void arena_commit(struct file_arena *arena)
 {
-    wchar_t saved_path[PATH_MAX];
-    mbstowcs(saved_path, path, PATH_MAX);
-    saved_path[PATH_MAX - 1] = 0;
+    arena->used++;
+    if (arena->used > arena->peak)  arena->peak = arena->used;
+}
 
-    int path_length = wcslen(saved_path);
 
-    /* максимальное количество символов, на которое мы можем промотать */
-    int max_scroll = path_length - ws.ws_col;
-    if (max_scroll < 0) max_scroll = 0;
+/* освобождаем записи начиная с mark, память остаётся за ареной */
+void arena_release(struct file_arena *arena, unsigned int mark)
+{
+    if (mark < arena->used)  arena->used = mark;
+}
 
-    if (path_scroll > max_scroll) path_scroll = max_scroll;
-    if (path_scroll < 0)          path_scroll = 0;
 
-    wchar_t displayed_path[PATH_MAX];
+void arena_free(struct file_arena *arena)
+{
+    free(arena->data);
+    arena->data = NULL;
+    arena->used = 0;
+    arena->capacity = 0;
+}
 
-    /* весь путь помещается */
-    if (path_length <= ws.ws_col)
-    {
-        wcscpy(displayed_path, saved_path);
-    }
-    /* в начале - только '>' справа */
-    else if (path_scroll == 0)
-    {
-        wcscpy(displayed_path, saved_path);
-        displayed_path[ws.ws_col - 1] = L'>';
-        displayed_path[ws.ws_col] = 0;
-    }
-    /* в конце - только '<' слева */
-    else if (path_scroll == max_scroll)
-    {
-        displayed_path[0] = L'<';
-        wcscpy(displayed_path + 1, saved_path + path_scroll + 1);
-        displayed_path[ws.ws_col] = 0;
-    }
-    /* между - и '<', и '>' */
-    else
-    {
-        displayed_path[0] = L'<';
-        wcscpy(displayed_path + 1, saved_path + path_scroll + 1);
-        displayed_path[ws.ws_col - 1] = L'>';
-        displayed_path[ws.ws_col] = 0;
-    }
 
-    wprintf(L"\e[1;38;5;200m%-*ls\e[0m\n", ws.ws_col, displayed_path);
+/* пиковое использование арены в байтах */
+size_t arena_peak_bytes(struct file_arena *arena)
+{
+    return (size_t)arena->peak * sizeof(struct file_info);
 }
 
 
-void print_string(char *str, unsigned int column_width, unsigned int column_index) {
-    if (column_width <= 0) return;
+/* порядок сортировки: столбец таблицы (номера как у active_column),
+к нему - флаг SORT_DESCENDING. Каталоги всегда идут первыми, при равных
+значениях столбца записи идут по имени */
+#define SORT_NAME        0
+#define SORT_COLUMNS     TABLE_COLUMNS
+#define SORT_DESCENDING  8
+#define SORT_COLUMN(mode)  ((mode) & (SORT_DESCENDING - 1))
 
-    wchar_t displayed_string[NAME_MAX];
-    mbstowcs(displayed_string, str, NAME_MAX);
-    displayed_string[NAME_MAX - 1] = 0;
+int sort_mode = SORT_NAME;   /* выбран в терминале клавишей 's' */
+int order_sort = SORT_NAME;  /* по нему отсортирован текущий order */
 
-    int string_length = wcslen(displayed_string);
+/* ключ сортировки: флаг каталога, значение столбца, первые 8 байт имени
+и индекс записи в массиве file_info */
+struct sort_key
+{
+    unsigned long long value;   /* сырое поле столбца; для убывания - инвертированное */
+    unsigned long long prefix;  /* первые 8 байт имени в порядке big-endian */
+    const char *name;
+    unsigned int index;
+    unsigned short is_dir;
+    unsigned short name_descending;  /* сортировка по имени в обратном порядке */
+};
 
-    /* если строка полностью помещается */
-    if (string_length <= column_width)
-    {
-        wprintf(L"%-*ls", column_width, displayed_string);
-        return;
-    }
 
-    int s = column_scrolls[column_index];
-    if (s < 0) s = 0;
-    if (s > string_length - column_width) s = string_length - column_width;
-    column_scrolls[column_index] = s;
+/* наносекунды; время дальше ±292 лет от эпохи (битые метки, чужие ФС)
+прижимаем к краю диапазона, иначе умножение переполнится */
+long long time_ns(const struct timespec *time)
+{
+    if (time->tv_sec >= LLONG_MAX / 1000000000LL)   return LLONG_MAX;
+    if (time->tv_sec <= LLONG_MIN / 1000000000LL)   return LLONG_MIN;
+    return time->tv_sec * 1000000000LL + time->tv_nsec;
+}
 
-    wchar_t buf[NAME_MAX];
 
-    /* заполним буфер пробелами */
-    for (int i = 0; i < column_width; i++) buf[i] = L' ';
-    buf[column_width] = 0;
+/* время как беззнаковое число с тем же порядком, что и у знакового */
+unsigned long long time_key(const struct timespec *time)
+{
+    return (unsigned long long)time_ns(time) ^ (1ULL << 63);
+}
 
-    /* копируем видимую часть строки */
-    wcsncpy(buf, displayed_string + s, column_width);
 
-    if (s > 0) buf[0] = L'<';
-    if (s + column_width < string_length) buf[column_width - 1] = L'>';
+/* столбец size: занятое на диске место, как у du, или длина ('b' в терминале) */
+int size_apparent = 0;
 
-    wprintf(L"%-*ls", column_width, buf);
+unsigned long long size_value(const struct file_info *file)
+{
+    return size_apparent ? file->size : file->blocks * 512;
 }
 
 
-void display_data(struct file_info file, unsigned int columns[], struct winsize ws)
+/* заполняем ключ: тип и значение столбца берём один раз на запись, а не на каждое сравнение */
+void make_sort_key(struct file_info *file, unsigned int index, int mode, struct sort_key *key)
 {
-    char *file_ptr;
-    for (unsigned int i = 0; i < 7; i++)
-    {
-        switch (i)
-        {
-            case 0: file_ptr = file.name;         break;
-            case 1: file_ptr = file.type;         break;
-            case 2: file_ptr = file.uid;          break;
-            case 3: file_ptr = file.gid;          break;
-            case 4: file_ptr = file.permissions;  break;
-            case 5: file_ptr = file.mtime;        break;
-            case 6: file_ptr = file.atime;        break;
-        }
+    key->prefix = 0;
+    key->name = file->real_name;
+    key->index = index;
+    key->is_dir = S_ISDIR(file->mode);
+    key->name_descending = (mode == (SORT_NAME | SORT_DESCENDING));
 
-        print_string(file_ptr, columns[i], i);
+    switch (SORT_COLUMN(mode))
+    {
+        default: key->value = 0;                       break;
+        case 1:  key->value = file->mode & S_IFMT;     break;
+        case 2:  key->value = file->uid;               break;
+        case 3:  key->value = file->gid;               break;
+        case 4:  key->value = file->mode & 07777;      break;
+        case 5:  key->value = time_key(&file->mtim);   break;
+        case 6:  key->value = time_key(&file->atim);   break;
+        case 7:  key->value = size_value(file);        break;
+    }
+    if (mode & SORT_DESCENDING)  key->value = ~key->value;
 
-        if (i < 6) wprintf(L"|");
+    for (unsigned int i = 0; i < 8 && file->real_name[i] != 0; i++)
+    {
+        key->prefix |= (unsigned long long)(unsigned char)file->real_name[i] << (56 - 8 * i);
     }
-    putwchar(L'\n');
 }
 
 
-int display_in_terminal(char *path)
+/* сначала каталоги, затем по значению столбца, затем лексикографически по имени */
+int compare(const void *key_1, const void *key_2)
 {
-    /* очищаем экран и перемещаем курсор на начало экрана */
-    wprintf(L"\e[2J\e[H");
+    const struct sort_key *k1 = key_1;
+    const struct sort_key *k2 = key_2;
+
+    if (k1->is_dir != k2->is_dir)  return k1->is_dir ? -1 : 1;  /* каталоги выводим первыми */
+    if (k1->value != k2->value)    return k1->value < k2->value ? -1 : 1;
+
+    /* префикс сравнивается так же, как strcmp сравнивает первые 8 байт */
+    int result;
+    if (k1->prefix != k2->prefix)         result = k1->prefix < k2->prefix ? -1 : 1;
+    else if ((k1->prefix & 0xff) == 0)    result = 0;  /* имя короче 8 байт целиком вошло в префикс */
+    else                                  result = strcmp(k1->name + 8, k2->name + 8);
+    return k1->name_descending ? -result : result;
+}
+
+
+/* сортировка перестановки индексов за O(n log n): сами записи не перемещаются,
+files[order[i]] - i-я запись в порядке вывода */
+int sort(struct file_info *files, unsigned int count, unsigned int **order, int mode)
+{
+    unsigned int *tmp = realloc(*order, (count > 0 ? count : 1) * sizeof(unsigned int));
+    if (tmp == NULL)  return -1;
+    *order = tmp;
+
+    if (files == NULL || count == 0)  return 0;
+
+    struct sort_key *keys = malloc(count * sizeof(struct sort_key));
+    if (keys == NULL)  return -1;
+
+    unsigned long long start = stats_begin();
+    unsigned long long traced = trace_begin();
+    for (unsigned int i = 0; i < count; i++)
+    {
+        make_sort_key(&files[i], i, mode, &keys[i]);
+    }
+
+    qsort(keys, count, sizeof(struct sort_key), compare);
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        (*order)[i] = keys[i].index;
+    }
+    stats_end(PHASE_SORT, start);
+    trace_end("sort", traced, "%u", count);
+
+    free(keys);
+    return 0;
+}
+
+
+/* добавляем в отсортированную перестановку order (count записей) новые
+записи files[count..count + added): сортируем только их и сливаем за O(n) */
+int sort_merge(struct file_info *files, unsigned int count, unsigned int added, unsigned int **order, int mode)
+{
+    unsigned int *merged = malloc((count + added > 0 ? count + added : 1) * sizeof(unsigned int));
+    struct sort_key *keys = malloc((added > 0 ? added : 1) * sizeof(struct sort_key));
+    if (merged == NULL || keys == NULL)
+    {
+        free(merged);
+        free(keys);
+        return -1;
+    }
+
+    unsigned long long start = stats_begin();
+    unsigned long long traced = trace_begin();
+    for (unsigned int i = 0; i < added; i++)
+    {
+        make_sort_key(&files[count + i], count + i, mode, &keys[i]);
+    }
+    qsort(keys, added, sizeof(struct sort_key), compare);
+
+    unsigned int i = 0, j = 0, k = 0;
+    struct sort_key old_key;
+    while (i < count && j < added)
+    {
+        make_sort_key(&files[(*order)[i]], (*order)[i], mode, &old_key);
+        if (compare(&old_key, &keys[j]) <= 0)  merged[k++] = (*order)[i++];
+        else                                   merged[k++] = keys[j++].index;
+    }
+    while (i < count)  merged[k++] = (*order)[i++];
+    while (j < added)  merged[k++] = keys[j++].index;
+    stats_end(PHASE_SORT, start);
+    trace_end("sort merge", traced, "%u + %u", count, added);
+
+    free(keys);
+    free(*order);
+    *order = merged;
+    return 0;
+}
+
+
+/* получаем имя с экранированием символов '<' и '>' */
+void get_name(const char *real_name, char *name)
+{
+    unsigned int j = 0;
+    for (unsigned int i = 0; real_name[i] != 0; i++)
+    {
+        if (real_name[i] == '<' || real_name[i] == '>')
+        {
+            name[j++] = '\\';
+        }
+        name[j++] = real_name[i];
+    }
+    name[j] = 0;
+}
+
+
+/* получаем тип объекта файловой системы*/
+void get_type(const struct file_info *file, char *type)
+{
+    switch (file->mode & S_IFMT)
+    {
+        case S_IFBLK:   strcpy(type, "block device");       break;
+        case S_IFCHR:   strcpy(type, "character device");   break;
+        case S_IFDIR:   strcpy(type, "directory");          break;
+        case S_IFIFO:   strcpy(type, "FIFO");               break;
+        case S_IFLNK:   strcpy(type, "symlink");            break;
+        case S_IFREG:   strcpy(type, "regular file");       break;
+        case S_IFSOCK:  strcpy(type, "socket");             break;
+        default:        strcpy(type, "unknown");            break;
+    }
+}
+
+/* кэш имён пользователей и групп: открытая адресация по id.
+Запрос к NSS (а это может быть LDAP/sssd) делается один раз на id,
+неизвестные id тоже запоминаются и выводятся числом */
+struct id_cache_entry
+{
+    unsigned int id;
+    int used;
+    int known;  /* 0 - NSS не знает такого id, в name лежит число */
+    char name[ID_MAX];
+};
+
+struct id_cache
+{
+    struct id_cache_entry *entries;
+    unsigned int count;
+    unsigned int capacity;  /* степень двойки */
+    unsigned long hits;
+    unsigned long misses;
+};
+
+#define ID_CACHE_MIN_CAPACITY 64
+
+/* общие для терминала и рекурсивного вывода, в том числе для всех его потоков */
+struct id_cache owner_cache;
+struct id_cache group_cache;
+pthread_mutex_t id_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+struct id_cache_entry *id_cache_find(struct id_cache *cache, unsigned int id)
+{
+    unsigned int mask = cache->capacity - 1;
+    unsigned int i = (id * 2654435761u) & mask;
+    while (cache->entries[i].used && cache->entries[i].id != id)
+    {
+        i = (i + 1) & mask;
+    }
+    return &cache->entries[i];
+}
+
+
+/* увеличиваем таблицу вдвое при заполнении больше чем на 3/4 */
+int id_cache_grow(struct id_cache *cache)
+{
+    unsigned int capacity = cache->capacity * 2;
+    if (capacity < ID_CACHE_MIN_CAPACITY)  capacity = ID_CACHE_MIN_CAPACITY;
+
+    struct id_cache_entry *entries = calloc(capacity, sizeof(struct id_cache_entry));
+    if (entries == NULL)  return -1;
+
+    struct id_cache old = *cache;
+    cache->entries = entries;
+    cache->capacity = capacity;
+
+    for (unsigned int i = 0; i < old.capacity; i++)
+    {
+        if (old.entries[i].used)
+        {
+            *id_cache_find(cache, old.entries[i].id) = old.entries[i];
+        }
+    }
+    free(old.entries);
+    return 0;
+}
+
+
+/* запрос к NSS: 1 - имя найдено, 0 - id неизвестен */
+int resolve_id(unsigned int id, int is_group, char *name)
+{
+    long size = sysconf(is_group ? _SC_GETGR_R_SIZE_MAX : _SC_GETPW_R_SIZE_MAX);
+    if (size <= 0)  size = 1024;
+
+    while (1)
+    {
+        char *buf = malloc(size);
+        if (buf == NULL)  break;
+
+        int err;
+        const char *found = NULL;
+        if (is_group)
+        {
+            struct group gr, *result = NULL;
+            err = getgrgid_r(id, &gr, buf, size, &result);
+            if (result != NULL)  found = result->gr_name;
+        }
+        else
+        {
+            struct passwd pw, *result = NULL;
+            err = getpwuid_r(id, &pw, buf, size, &result);
+            if (result != NULL)  found = result->pw_name;
+        }
+
+        if (found != NULL)
+        {
+            snprintf(name, ID_MAX, "%s", found);
+            free(buf);
+            return 1;
+        }
+        free(buf);
+
+        /* буфер мал для записи - повторяем с большим */
+        if (err != ERANGE)  break;
+        size *= 2;
+    }
+
+    snprintf(name, ID_MAX, "%u", id);
+    return 0;
+}
+
+
+/* имя по id через кэш: 0 - имя найдено, -1 - id неизвестен, в name число */
+int id_cache_lookup(struct id_cache *cache, unsigned int id, int is_group, char *name)
+{
+    pthread_mutex_lock(&id_cache_lock);
+
+    if (cache->capacity > 0)
+    {
+        struct id_cache_entry *entry = id_cache_find(cache, id);
+        if (entry->used)
+        {
+            cache->hits++;
+            strcpy(name, entry->name);
+            pthread_mutex_unlock(&id_cache_lock);
+            return entry->known ? 0 : -1;
+        }
+    }
+
+    cache->misses++;
+    stats_add(STAT_NSS, 1);
+    unsigned long long start = stats_begin();
+    int known = resolve_id(id, is_group, name);
+    stats_end(PHASE_NSS, start);
+
+    /* без памяти под таблицу просто работаем без кэша */
+    if ((cache->count + 1) * 4 > cache->capacity * 3 && id_cache_grow(cache) != 0)
+    {
+        pthread_mutex_unlock(&id_cache_lock);
+        return known ? 0 : -1;
+    }
+
+    struct id_cache_entry *entry = id_cache_find(cache, id);
+    entry->id = id;
+    entry->used = 1;
+    entry->known = known;
+    strcpy(entry->name, name);
+    cache->count++;
+
+    pthread_mutex_unlock(&id_cache_lock);
+    return known ? 0 : -1;
+}
+
+
+void id_cache_free(struct id_cache *cache)
+{
+    free(cache->entries);
+    cache->entries = NULL;
+    cache->count = 0;
+    cache->capacity = 0;
+}
+
+
+/* получаем имя владельца */
+int get_owner(const struct file_info *file, char *uid)
+{
+    if (id_cache_lookup(&owner_cache, file->uid, 0, uid) != 0)  return -2;
+    return 0;
+}
+
+/* получаем имя группы */
+int get_group(const struct file_info *file, char *gid)
+{
+    if (id_cache_lookup(&group_cache, file->gid, 1, gid) != 0)  return -3;
+    return 0;
+}
+
+/* получаем права доступа */
+void get_permissions(const struct file_info *file, char *permissions)
+{
+    mode_t mode = file->mode;
+    strcpy(permissions, "----------");
+
+    /* первый символ */
+    if (S_ISDIR(mode))       permissions[0] = 'd';
+    else if (S_ISFIFO(mode)) permissions[0] = 'p';
+    else if (S_ISLNK(mode))  permissions[0] = 'l';
+    else if (S_ISBLK(mode))  permissions[0] = 'b';
+    else if (S_ISCHR(mode))  permissions[0] = 'c';
+    else if (S_ISSOCK(mode)) permissions[0] = 's';
+
+    /* rwxrwxrwx */
+    if (mode & S_IRUSR) permissions[1] = 'r';
+    if (mode & S_IWUSR) permissions[2] = 'w';
+    if (mode & S_IXUSR) permissions[3] = 'x';
+    if (mode & S_IRGRP) permissions[4] = 'r';
+    if (mode & S_IWGRP) permissions[5] = 'w';
+    if (mode & S_IXGRP) permissions[6] = 'x';
+    if (mode & S_IROTH) permissions[7] = 'r';
+    if (mode & S_IWOTH) permissions[8] = 'w';
+    if (mode & S_IXOTH) permissions[9] = 'x';
+}
+
+/* кэш форматирования времени, свой у каждого потока: localtime_r - раз
+на локальные сутки (с переходом на летнее время - на минуту) */
+
+#define TIME_CACHE_SLOTS 16
+
+struct time_cache
+{
+    time_t start;          /* отрезок [start, end) с неизменным смещением UTC */
+    time_t end;
+    int base_minutes;      /* местное время в start, минут от полуночи */
+    char date[11];         /* "dd.mm.YYYY" */
+};
+
+__thread struct time_cache time_cache[TIME_CACHE_SLOTS];
+
+
+void put_digits(char *dst, int value, int count)
+{
+    for (int i = count - 1; i >= 0; i--)
+    {
+        dst[i] = '0' + value % 10;
+        value /= 10;
+    }
+}
+
+
+/* время в формате "%d.%m.%Y  %H:%M" (01.01.2000  12:30); -1 - ошибка localtime_r */
+int format_time(time_t t, char *str)
+{
+    struct time_cache *slot = &time_cache[(unsigned long long)(t / 86400) % TIME_CACHE_SLOTS];
+
+    if (t < slot->start || t >= slot->end)
+    {
+        struct tm tm;
+        if (localtime_r(&t, &tm) == NULL)  return -1;
+
+        int year = tm.tm_year + 1900;
+        if (year < 1000 || year > 9999)
+        {
+            /* strftime не дополняет %Y нулями - такие годы не кэшируем */
+            strftime(str, TIME_MAX, "%d.%m.%Y  %H:%M", &tm);
+            return 0;
+        }
+
+        /* сутки целиком, если в их начале и конце то же смещение и та же дата */
+        time_t day_start = t - (tm.tm_hour * 3600 + tm.tm_min * 60 + tm.tm_sec);
+        time_t day_last = day_start + 86399;
+        struct tm first, last;
+        if (localtime_r(&day_start, &first) != NULL && localtime_r(&day_last, &last) != NULL
+            && first.tm_gmtoff == tm.tm_gmtoff && last.tm_gmtoff == tm.tm_gmtoff
+            && first.tm_mday == tm.tm_mday && last.tm_mday == tm.tm_mday
+            && first.tm_hour == 0 && first.tm_min == 0 && first.tm_sec == 0)
+        {
+            slot->start = day_start;
+            slot->end = day_start + 86400;
+            slot->base_minutes = 0;
+        }
+        else
+        {
+            slot->start = t - tm.tm_sec;
+            slot->end = slot->start + 60;
+            slot->base_minutes = tm.tm_hour * 60 + tm.tm_min;
+        }
+
+        put_digits(slot->date, tm.tm_mday, 2);
+        slot->date[2] = '.';
+        put_digits(slot->date + 3, tm.tm_mon + 1, 2);
+        slot->date[5] = '.';
+        put_digits(slot->date + 6, year, 4);
+    }
+
+    int minutes = slot->base_minutes + (int)((t - slot->start) / 60);
+    memcpy(str, slot->date, 10);
+    str[10] = ' ';
+    str[11] = ' ';
+    put_digits(str + 12, minutes / 60, 2);
+    str[14] = ':';
+    put_digits(str + 15, minutes % 60, 2);
+    str[17] = 0;
+    return 0;
+}
+
+
+/* получаем дату модификации */
+int get_mtime(const struct file_info *file, char *mtime)
+{
+    if (format_time(file->mtim.tv_sec, mtime) != 0)  return -4;
+    return 0;
+}
+
+/* получаем дату доступа */
+int get_atime(const struct file_info *file, char *atime)
+{
+    if (format_time(file->atim.tv_sec, atime) != 0)  return -5;
+    return 0;
+}
+
+
+/* размер в единицах по 1024, как у du -h: 1023, 1.5K, 12K, 3.4G */
+void format_size(unsigned long long value, char *str)
+{
+    if (value < 1024)
+    {
+        snprintf(str, BYTES_MAX, "%llu", value);
+        return;
+    }
+
+    const char *units = "KMGTPE";
+    unsigned int unit = 0;
+    double scaled = value / 1024.0;
+    while (scaled >= 1024 && unit < 5)
+    {
+        scaled /= 1024;
+        unit++;
+    }
+    snprintf(str, BYTES_MAX, scaled < 10 ? "%.1f%c" : "%.0f%c", scaled, units[unit]);
+}
+
+
+/* получаем размер; сумма каталога, пока идёт подсчёт, помечается '+' */
+void get_size(const struct file_info *file, char *size)
+{
+    if (file->pending || file->total == DU_UNKNOWN || file->total == DU_QUEUED)
+    {
+        size[0] = 0;
+        return;
+    }
+
+    format_size(size_value(file), size);
+    if (file->total == DU_PARTIAL)  strcat(size, "+");
+}
+
+
+/* собираем строки всех колонок для одной записи;
+неизвестные uid/gid get_owner/get_group выводят числом, а не теряют запись */
+void format_row(const struct file_info *file, struct file_row *row)
+{
+    unsigned long long start = stats_begin();
+    get_name(file->real_name, row->name);
+
+    /* атрибуты ещё загружаются: показываем имя и тип, если он уже известен */
+    if (file->pending)
+    {
+        if (file->mode != 0)  get_type(file, row->type);
+        else                  row->type[0] = 0;
+        row->uid[0] = row->gid[0] = row->permissions[0] = row->mtime[0] = row->atime[0] = 0;
+        stats_end(PHASE_FORMAT, start);
+        return;
+    }
+
+    get_type(file, row->type);
+    get_owner(file, row->uid);
+    get_group(file, row->gid);
+    get_permissions(file, row->permissions);
+
+    if (get_mtime(file, row->mtime) != 0)  row->mtime[0] = 0;
+    if (get_atime(file, row->atime) != 0)  row->atime[0] = 0;
+    stats_end(PHASE_FORMAT, start);
+}
+
+
+/* строка для записи files[index] из кэша, форматируем только при промахе */
+struct file_row *get_row(unsigned int index)
+{
+    struct row_cache_entry *entry = &row_cache[index % ROW_CACHE_SIZE];
+    if (entry->generation != listing_generation || entry->index != index)
+    {
+        format_row(&files[index], &entry->row);
+        get_size(&files[index], entry->row.size);
+        entry->index = index;
+        entry->generation = listing_generation;
+    }
+    return &entry->row;
+}
+
+
+/* список сменился - строки в кэше больше не действительны */
+void invalidate_rows()
+{
+    listing_generation++;
+    if (listing_generation == 0)  listing_generation = 1;
+}
+
+/* буфер вывода в файл: строки копируются в него байтами без перекодировки
+через широкий поток и сбрасываются крупными write() */
+struct out_buf
+{
+    char *data;
+    size_t used;
+    size_t capacity;
+    int fd;  /* -1 - только накапливаем в памяти */
+    int error;  /* запись не удалась, дальнейший вывод отбрасываем */
+};
+
+#define OUT_BUF_SIZE (1 << 20)
+
+struct out_buf dump_out = { .fd = 1 };  /* stdout при выводе в файл */
+int utf8_locale = 0;                    /* в UTF-8 символы считаем без mbrlen */
+
+
+int out_flush(struct out_buf *out)
+{
+    if (out->error)  return -1;
+
+    unsigned long long start = stats_begin();
+    size_t written = 0;
+    while (out->fd != -1 && written < out->used)
+    {
+        ssize_t n = write(out->fd, out->data + written, out->used - written);
+        stats_add(STAT_WRITES, 1);
+        if (n == -1 && errno == EINTR)  continue;
+        if (n <= 0)
+        {
+            out->error = 1;
+            out->used = 0;
+            return -1;
+        }
+        written += n;
+    }
+    stats_add(STAT_BYTES, written);
+    stats_end(PHASE_OUTPUT, start);
+    out->used = 0;
+    return 0;
+}
+
+
+/* место ещё под size байт: файловый буфер сбрасываем, память увеличиваем */
+int out_reserve(struct out_buf *out, size_t size)
+{
+    if (out->error)  return -1;
+    if (out->used + size <= out->capacity)  return 0;
+
+    if (out->fd != -1 && out->used > 0)
+    {
+        if (out_flush(out) != 0)  return -1;
+        if (out->used + size <= out->capacity)  return 0;
+    }
+
+    size_t capacity = out->capacity ? out->capacity : (out->fd != -1 ? OUT_BUF_SIZE : 4096);
+    while (capacity < out->used + size)  capacity *= 2;
+
+    char *tmp = realloc(out->data, capacity);
+    if (tmp == NULL)  return -1;
+    out->data = tmp;
+    out->capacity = capacity;
+    return 0;
+}
+
+
+void out_write(struct out_buf *out, const char *data, size_t size)
+{
+    if (out_reserve(out, size) != 0)  return;
+    memcpy(out->data + out->used, data, size);
+    out->used += size;
+}
+
+
+void out_puts(struct out_buf *out, const char *str)
+{
+    out_write(out, str, strlen(str));
+}
+
+
+void out_free(struct out_buf *out)
+{
+    free(out->data);
+    out->data = NULL;
+    out->used = 0;
+    out->capacity = 0;
+}
+
+
+/* длина строки в символах - так же считал ширину wprintf("%-*ls") */
+unsigned int string_length(const char *str, size_t size)
+{
+    unsigned int length = 0;
+    if (utf8_locale)
+    {
+        /* считаем все байты, кроме продолжений многобайтовых символов */
+        for (size_t i = 0; i < size; i++)
+        {
+            if (((unsigned char)str[i] & 0xc0) != 0x80)  length++;
+        }
+        return length;
+    }
+
+    mbstate_t state;
+    memset(&state, 0, sizeof(state));
+    for (size_t i = 0; i < size; length++)
+    {
+        size_t n = mbrlen(str + i, size - i, &state);
+        if (n == (size_t)-1 || n == (size_t)-2 || n == 0)
+        {
+            memset(&state, 0, sizeof(state));
+            n = 1;
+        }
+        i += n;
+    }
+    return length;
+}
+
+
+/* строка, дополненная пробелами до width символов */
+void out_pad(struct out_buf *out, const char *str, unsigned int width)
+{
+    size_t size = strlen(str);
+    unsigned int length = string_length(str, size);
+    unsigned int padding = (length < width) ? width - length : 0;
+
+    if (out_reserve(out, size + padding) != 0)  return;
+    memcpy(out->data + out->used, str, size);
+    memset(out->data + out->used + size, ' ', padding);
+    out->used += size + padding;
+}
+
+
+/* широкая строка в многобайтовой кодировке локали, как её вывел бы wprintf */
+void out_wide(struct out_buf *out, const wchar_t *str)
+{
+    size_t size = wcstombs(NULL, str, 0);
+    if (size == (size_t)-1 || out_reserve(out, size + 1) != 0)  return;
+    wcstombs(out->data + out->used, str, size + 1);
+    out->used += size;
+}
+
+
+/* формат вывода в файл (--format): кроме таблицы - запись на каждый объект
+с полным путём и сырыми полями stat; ошибки тогда идут в stderr */
+
+enum dump_format
+{
+    FORMAT_TEXT,
+    FORMAT_NDJSON,  /* {"path":...,"mode":...,"uid":...,"gid":...,"mtime_ns":...,"atime_ns":...} */
+    FORMAT_CSV,     /* RFC 4180: заголовок, строки через CRLF, поля с , " CR LF - в кавычках */
+    FORMAT_BINARY   /* после BINARY_MAGIC записи, см. write_binary_record */
+};
+
+#define BINARY_MAGIC "FMDUMP1\n"
+
+enum dump_format dump_format = FORMAT_TEXT;
+char *snapshot_save_path = NULL;   /* -S: сохранить снимок дерева и выйти, сообщения - в stderr */
+char *snapshot_since_path = NULL;  /* -i: повторный обход относительно снимка, сообщения - в stderr */
+
+
+/* куда пишет сканер: NULL - stdout через wprintf (терминал). При выводе в файл
+это буфер вывода, чтобы сообщение оказалось между строками там же, где и раньше */
+__thread struct out_buf *scan_out = NULL;
+
+/* сообщения сканера не нужны: о тех же ошибках уже сообщили раньше */
+__thread int scan_quiet = 0;
+
+
+void scan_error(const wchar_t *message)
+{
+    if (scan_quiet)  return;
+    if (snapshot_save_path != NULL || snapshot_since_path != NULL)
+    {
+        fwprintf(stderr, L"%ls\n", message);
+        return;
+    }
+    if (scan_out == NULL)
+    {
+        wprintf(L"\e[%d;1H%ls", rows, message);
+        fflush(stdout);
+        return;
+    }
+    if (dump_format != FORMAT_TEXT)
+    {
+        /* в машинном формате в потоке только записи */
+        fwprintf(stderr, L"%ls\n", message);
+        return;
+    }
+
+    char position[32];
+    int size = snprintf(position, sizeof(position), "\e[%d;1H", rows);
+    out_write(scan_out, position, size);
+    out_wide(scan_out, message);
+}
+
+
+/* флаги scan_directory */
+#define SCAN_TYPE_ONLY   1  /* нужен только тип: берём его из d_type без fstatat */
+#define SCAN_STATX_BATCH 2  /* сначала читаем все имена, затем statx пакетами через io_uring */
+#define SCAN_FOLLOW_LINKS 4 /* stat вместо lstat: ссылка получает тип и атрибуты цели (-L) */
+#define SCAN_ONE_FS      8  /* вывод в файл и суммы size не спускаются в другие файловые системы (-x) */
+
+int scan_flags = 0;  /* флаги, с которыми сканируют get_files и рекурсивный вывод */
+
+
+/* флаги fstatat/statx: по умолчанию ссылки не разыменовываем,
+иначе ссылка на предка зацикливает рекурсивный вывод */
+int stat_flags()
+{
+    return (scan_flags & SCAN_FOLLOW_LINKS) ? 0 : AT_SYMLINK_NOFOLLOW;
+}
+
+
+/* тип объекта по d_type; 0 - тип неизвестен без stat
+(если ссылки разыменовываются, нужен тип цели, и ссылку не классифицируем) */
+mode_t dtype_to_mode(unsigned char d_type)
+{
+    switch (d_type)
+    {
+        case DT_BLK:   return S_IFBLK;
+        case DT_CHR:   return S_IFCHR;
+        case DT_DIR:   return S_IFDIR;
+        case DT_FIFO:  return S_IFIFO;
+        case DT_REG:   return S_IFREG;
+        case DT_SOCK:  return S_IFSOCK;
+        case DT_LNK:   return (scan_flags & SCAN_FOLLOW_LINKS) ? 0 : S_IFLNK;
+        default:       return 0;
+    }
+}
+
+
+/* множество каталогов (st_dev, st_ino), уже попавших в вывод: второй раз
+тот же каталог (цикл через ссылку, bind-монтирование, жёсткая ссылка на
+каталог) не обходим. Открытая адресация, заполнение не больше половины */
+struct inode_set_entry
+{
+    dev_t dev;
+    ino_t ino;
+    int used;
+};
+
+struct inode_set
+{
+    struct inode_set_entry *entries;
+    size_t count;
+    size_t capacity;
+};
+
+
+struct inode_set_entry *inode_set_find(struct inode_set *set, dev_t dev, ino_t ino)
+{
+    size_t hash = (size_t)(ino * 0x9e3779b97f4a7c15ULL) ^ (size_t)dev;
+    size_t i = hash & (set->capacity - 1);
+    while (set->entries[i].used && (set->entries[i].dev != dev || set->entries[i].ino != ino))
+    {
+        i = (i + 1) & (set->capacity - 1);
+    }
+    return &set->entries[i];
+}
+
+
+int inode_set_contains(struct inode_set *set, dev_t dev, ino_t ino)
+{
+    return set->capacity > 0 && inode_set_find(set, dev, ino)->used;
+}
+
+
+/* 1 - добавили, 0 - уже был, -1 - нет памяти */
+int inode_set_insert(struct inode_set *set, dev_t dev, ino_t ino)
+{
+    if (2 * (set->count + 1) > set->capacity)
+    {
+        struct inode_set grown = { .capacity = set->capacity ? set->capacity * 2 : 256 };
+        grown.entries = calloc(grown.capacity, sizeof(struct inode_set_entry));
+        if (grown.entries == NULL)  return -1;
+
+        for (size_t i = 0; i < set->capacity; i++)
+        {
+            if (set->entries[i].used)  *inode_set_find(&grown, set->entries[i].dev, set->entries[i].ino) = set->entries[i];
+        }
+        grown.count = set->count;
+        free(set->entries);
+        *set = grown;
+    }
+
+    struct inode_set_entry *entry = inode_set_find(set, dev, ino);
+    if (entry->used)  return 0;
+    entry->dev = dev;
+    entry->ino = ino;
+    entry->used = 1;
+    set->count++;
+    return 1;
+}
+
+
+void inode_set_free(struct inode_set *set)
+{
+    free(set->entries);
+    set->entries = NULL;
+    set->count = 0;
+    set->capacity = 0;
+}
+
+
+/* кольцо io_uring, отображённое в память процесса (без liburing) */
+struct uring
+{
+    int fd;
+    unsigned int entries;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_size;
+    size_t cq_size;
+    size_t sqes_size;
+};
+
+#define URING_ENTRIES 256
+
+/* для колонок нужны только эти поля statx */
+#define STATX_COLUMNS (STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID | STATX_MTIME | STATX_ATIME | STATX_SIZE | STATX_BLOCKS)
+
+/* у каждого потока обхода своё кольцо */
+__thread struct uring stat_ring = { .fd = -1 };
+__thread int stat_ring_unavailable = 0;  /* io_uring не поддерживается - работаем через fstatat */
+
+
+int uring_init(struct uring *ring, unsigned int entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd == -1)  return -1;
+
+    ring->entries = params.sq_entries;
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        if (ring->sq_ptr != MAP_FAILED)  munmap(ring->sq_ptr, ring->sq_size);
+        if (ring->cq_ptr != MAP_FAILED)  munmap(ring->cq_ptr, ring->cq_size);
+        if (ring->sqes != MAP_FAILED)    munmap(ring->sqes, ring->sqes_size);
+        close(ring->fd);
+        ring->fd = -1;
+        return -1;
+    }
+
+    ring->sq_tail = (unsigned int *)((char *)ring->sq_ptr + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)((char *)ring->sq_ptr + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)((char *)ring->sq_ptr + params.sq_off.array);
+    ring->cq_head = (unsigned int *)((char *)ring->cq_ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)((char *)ring->cq_ptr + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)((char *)ring->cq_ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr + params.cq_off.cqes);
+    return 0;
+}
+
+
+void uring_free(struct uring *ring)
+{
+    if (ring->fd == -1)  return;
+    munmap(ring->sq_ptr, ring->sq_size);
+    munmap(ring->cq_ptr, ring->cq_size);
+    munmap(ring->sqes, ring->sqes_size);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+
+void fill_from_statx(struct file_info *file, const struct statx *stx)
+{
+    file->mode = stx->stx_mode;
+    file->uid = stx->stx_uid;
+    file->gid = stx->stx_gid;
+    file->mtim.tv_sec = stx->stx_mtime.tv_sec;
+    file->mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+    file->atim.tv_sec = stx->stx_atime.tv_sec;
+    file->atim.tv_nsec = stx->stx_atime.tv_nsec;
+    file->size = stx->stx_size;
+    file->blocks = stx->stx_blocks;
+    file->total = S_ISDIR(stx->stx_mode) ? DU_UNKNOWN : DU_COMPLETE;
+}
+
+
+/* statx пакетами по ring->entries для записей с mode == 0; пакет ждёт все свои ответы.
+-1 - кольцо непригодно, остальные записи - через fstatat */
+
+int uring_stat_entries(struct uring *ring, int dir_fd, struct file_info *entries, unsigned int count)
+{
+    struct statx *bufs = malloc(ring->entries * sizeof(struct statx));
+    unsigned int *indexes = malloc(ring->entries * sizeof(unsigned int));
+    if (bufs == NULL || indexes == NULL)
+    {
+        free(bufs);
+        free(indexes);
+        return -1;
+    }
+
+    int result = 0;
+    unsigned int next = 0;
+    while (next < count && result == 0)
+    {
+        /* заполняем очередь отправки */
+        unsigned int tail = *ring->sq_tail;
+        unsigned int mask = *ring->sq_mask;
+        unsigned int batch = 0;
+        for (; next < count && batch < ring->entries; next++)
+        {
+            if (entries[next].mode != 0)  continue;
+
+            struct io_uring_sqe *sqe = &ring->sqes[tail & mask];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = dir_fd;
+            sqe->addr = (unsigned long)entries[next].real_name;
+            sqe->len = STATX_COLUMNS;
+            sqe->statx_flags = stat_flags();
+            sqe->off = (unsigned long)&bufs[batch];
+            sqe->user_data = batch;
+            ring->sq_array[tail & mask] = tail & mask;
+
+            indexes[batch++] = next;
+            tail++;
+        }
+        if (batch == 0)  break;
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+        stats_add(STAT_STATX, batch);
+
+        unsigned int submitted = 0;
+        unsigned int completed = 0;
+        while (completed < submitted || submitted < batch)
+        {
+            unsigned int to_submit = (result == 0) ? batch - submitted : 0;
+            if (to_submit == 0 && completed == submitted)  break;
+
+            int ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            if (ret == -1)
+            {
+                if (errno == EINTR || errno == EAGAIN || errno == EBUSY)  continue;
+                result = -1;  /* дожидаемся уже отправленных и выходим */
+                continue;
+            }
+            submitted += ret;
+
+            /* разбираем очередь завершений */
+            unsigned int head = *ring->cq_head;
+            while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+            {
+                struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+                unsigned int slot = cqe->user_data;
+                if (cqe->res == 0)
+                {
+                    fill_from_statx(&entries[indexes[slot]], &bufs[slot]);
+                }
+                else if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP)
+                {
+                    result = -1;  /* ядро не умеет IORING_OP_STATX */
+                }
+                else
+                {
+                    scan_error(L"Не удалось получить stat.");
+                }
+                head++;
+                completed++;
+            }
+            __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        }
+    }
+
+    free(bufs);
+    free(indexes);
+    return result;
+}
+
+
+/* fstatat одной записи относительно dir_fd: заполняем поля stat; -1 - ошибка */
+int stat_entry(int dir_fd, struct file_info *file)
+{
+    unsigned long long start = stats_begin();
+    struct stat st;
+    int result = fstatat(dir_fd, file->real_name, &st, stat_flags());
+    stats_end(PHASE_STAT, start);
+    stats_add(STAT_STAT, 1);
+    if (result == -1)  return -1;
+
+    file->mode = st.st_mode;
+    file->uid = st.st_uid;
+    file->gid = st.st_gid;
+    file->mtim = st.st_mtim;
+    file->atim = st.st_atim;
+    file->size = st.st_size;
+    file->blocks = st.st_blocks;
+    file->total = S_ISDIR(st.st_mode) ? DU_UNKNOWN : DU_COMPLETE;
+    return 0;
+}
+
+
+/* stat для записей с mode == 0 после того, как прочитаны все имена:
+пакетами через io_uring, а если его нет - по одному через fstatat */
+void stat_entries(int dir_fd, struct file_info *entries, unsigned int count)
+{
+    unsigned long long traced = trace_begin();
+    if (!stat_ring_unavailable && stat_ring.fd == -1 && uring_init(&stat_ring, URING_ENTRIES) != 0)
+    {
+        stat_ring_unavailable = 1;
+    }
+
+    if (!stat_ring_unavailable)
+    {
+        unsigned long long start = stats_begin();
+        int result = uring_stat_entries(&stat_ring, dir_fd, entries, count);
+        stats_end(PHASE_STAT, start);
+        if (result == 0)
+        {
+            trace_end("stat batch", traced, "%u statx", count);
+            return;
+        }
+
+        /* дальше не пытаемся: кольцо закрываем, недоделанное добираем fstatat */
+        uring_free(&stat_ring);
+        stat_ring_unavailable = 1;
+    }
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        if (entries[i].mode != 0)  continue;
+
+        if (stat_entry(dir_fd, &entries[i]) != 0)
+        {
+            scan_error(L"Не удалось получить stat.");
+        }
+    }
+    trace_end("stat batch", traced, "%u", count);
+}
+
+
+/* читаем каталог, открытый как dir_fd, и добавляем его объекты в арену.
+stat делается через fstatat относительно dir_fd, поэтому ядру не нужно
+заново разбирать весь путь для каждого объекта. dir_fd остаётся открытым */
+int scan_directory(int dir_fd, struct file_arena *arena, int flags)
+{
+    /* fdopendir забирает дескриптор себе, поэтому отдаём ему копию */
+    int fd = dup(dir_fd);
+    if (fd == -1)
+    {
+        scan_error(L"Не удалось открыть директорию.");
+        return -6;
+    }
+
+    DIR *dir = fdopendir(fd);
+    if (dir == NULL)
+    {
+        scan_error(L"Не удалось открыть директорию.");
+        close(fd);
+        return -6;
+    }
+    rewinddir(dir);  /* копия разделяет позицию чтения с dir_fd */
+
+    unsigned int base = arena->used;
+    struct dirent *rd;
+    stats_add(STAT_DIRS, 1);
+    unsigned long long traced = trace_begin();
+
+    while (1)
+    {
+        unsigned long long start = stats_begin();
+        errno = 0;  /* readdir сообщает об ошибке только через errno */
+        rd = readdir(dir);
+        stats_end(PHASE_READDIR, start);
+        stats_add(STAT_READDIR, 1);
+        if (rd == NULL)
+        {
+            if (errno != 0)
+            {
+                scan_error(L"Не удалось получить rd.");
+                closedir(dir);
+                return -7;
+            }
+            break;
+        }
+
+        /* пропускаем "." и ".." */
+        if (strcmp(rd->d_name, ".") == 0 || strcmp(rd->d_name, "..") == 0)
+            continue;
+
+        struct file_info *current_file = arena_reserve(arena);
+        if (current_file == NULL)
+        {
+            scan_error(L"Не удалось выделить память для tmp.");
+            closedir(dir);
+            return -8;
+        }
+
+        strcpy(current_file->real_name, rd->d_name);
+
+        /* если нужен только тип и файловая система его сообщила - stat не нужен */
+        mode_t type = dtype_to_mode(rd->d_type);
+        if ((flags & SCAN_TYPE_ONLY) && type != 0)
+        {
+            memset(current_file, 0, offsetof(struct file_info, real_name));
+            current_file->mode = type;
+            current_file->pending = 1;
+            arena_commit(arena);
+            continue;
+        }
+
+        /* stat сделаем пакетом после чтения всех имён; mode == 0 - stat ещё не было */
+        current_file->pending = 0;
+        if (flags & SCAN_STATX_BATCH)
+        {
+            current_file->mode = 0;
+            arena_commit(arena);
+            continue;
+        }
+
+        if (stat_entry(dir_fd, current_file) != 0)
+        {
+            scan_error(L"Не удалось получить stat.");
+            continue;
+        }
+
+        arena_commit(arena);
+    }
+
+    closedir(dir);
+
+    if (flags & SCAN_STATX_BATCH)
+    {
+        /* имена больше не добавляются, так что арена не переедет под запросами */
+        stat_entries(dir_fd, arena->data + base, arena->used - base);
+
+        /* убираем записи, для которых stat не удался, сохраняя порядок readdir */
+        unsigned int kept = base;
+        for (unsigned int i = base; i < arena->used; i++)
+        {
+            if (arena->data[i].mode == 0)  continue;
+            if (kept != i)  arena->data[kept] = arena->data[i];
+            kept++;
+        }
+        arena_release(arena, kept);
+    }
+
+    stats_add(STAT_ENTRIES, arena->used - base);
+    trace_end("scan", traced, "%u", arena->used - base);
+    return arena->used - base;
+}
+
+
+/* получаем список и кол-во объектов в каталоге */
+int get_files(char *path, struct file_arena *arena, struct file_info **files, unsigned int **order)
+{
+    int dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    stats_add(STAT_OPEN, 1);
+    if (dir_fd == -1)
+    {
+        wprintf(L"\e[%d;1HНе удалось открыть директорию.", rows);
+        fflush(stdout);
+        return -6;
+    }
+
+    /* старый список больше не нужен, память арены переиспользуем */
+    arena_release(arena, 0);
+
+    int result = scan_directory(dir_fd, arena, scan_flags);
+    close(dir_fd);
+    if (result < 0)  return result;
+
+    invalidate_rows();
+    listing_id++;
+    *files = arena->data;
+    file_counter = arena->used;
+    if (sort(*files, arena->used, order, order_sort) != 0)
+    {
+        wprintf(L"\e[%d;1HНе удалось выделить память для сортировки.", rows);
+        fflush(stdout);
+        return -8;
+    }
+    return arena->used;
+}
+
+
+
+/* фильтр по имени ('/' в терминале); новый символ сужает прошлый набор совпадений.
+visible_entry(i) - запись i-й видимой строки */
+
+#define FILTER_IGNORE_CASE 1   /* латиница без учёта регистра */
+#define FILTER_FUZZY       2   /* символы фильтра по порядку, не обязательно подряд */
+#define FILTER_ESC_MS      25  /* Esc без продолжения за это время - отдельная клавиша */
+
+struct filter
+{
+    int editing;              /* ввод идёт в строку фильтра */
+    int mode;
+    char pattern[NAME_MAX + 1];
+    unsigned int length;      /* 0 - фильтра нет */
+    unsigned int *matches;    /* подходящие записи в порядке order */
+    int count;
+    unsigned int capacity;
+    unsigned int generation;  /* меняется вместе с набором совпадений */
+};
+
+struct filter filter;
+
+
+int visible_count()
+{
+    return (filter.length > 0) ? filter.count : file_counter;
+}
+
+
+unsigned int visible_entry(int i)
+{
+    return (filter.length > 0) ? filter.matches[i] : order[i];
+}
+
+
+/* запись под курсором; -1 - курсор за концом списка */
+int cursor_entry()
+{
+    return (cursor_pos < visible_count()) ? (int)visible_entry(cursor_pos) : -1;
+}
+
+
+/* курсор на строку записи entry, строка курсора остаётся на том же месте экрана */
+void cursor_to_entry(int entry)
+{
+    int count = visible_count();
+    for (int i = 0; i < count; i++)
+    {
+        if ((int)visible_entry(i) == entry)
+        {
+            scroll_pos += i - cursor_pos;
+            if (scroll_pos < 0)  scroll_pos = 0;
+            cursor_pos = i;
+            return;
+        }
+    }
+}
+
+
+unsigned char fold_ascii(unsigned char c)
+{
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+
+int bytes_equal(const char *name, const char *pattern, int count, int fold)
+{
+    for (int i = 0; i < count; i++)
+    {
+        unsigned char c = name[i];
+        if ((fold ? fold_ascii(c) : c) != (unsigned char)pattern[i])  return 0;
+    }
+    return 1;
+}
+
+
+#ifdef __SSE2__
+/* fold_ascii для 16 байт сразу; байты UTF-8 отрицательны и под сравнение не попадают */
+__m128i fold_block(__m128i block)
+{
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(block, _mm_set1_epi8('A' - 1)),
+                                  _mm_cmplt_epi8(block, _mm_set1_epi8('Z' + 1)));
+    return _mm_or_si128(block, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+#endif
+
+
+/* первый байт c в name[from, length) или -1. Блоки по 16 байт читаем только
+внутри имени, хвост короче блока проверяем побайтно */
+int find_byte(const char *name, int from, int length, unsigned char c, int fold)
+{
+#ifdef __SSE2__
+    __m128i needle = _mm_set1_epi8(c);
+    for (; from + 16 <= length; from += 16)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i *)(name + from));
+        if (fold)  block = fold_block(block);
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+        if (mask != 0)  return from + __builtin_ctz(mask);
+    }
+#endif
+    for (; from < length; from++)
+    {
+        unsigned char byte = name[from];
+        if ((fold ? fold_ascii(byte) : byte) == c)  return from;
+    }
+    return -1;
+}
+
+
+/* подстрока pattern (k байт) в имени. Для 16 позиций сразу сравниваем первый
+и последний байт образца, целиком проверяем только совпавшие позиции.
+Блоки не выходят за конец имени */
+int match_substring(const char *name, int length, const char *pattern, int k, int fold)
+{
+    int last = length - k;  /* последняя позиция, с которой образец ещё помещается */
+    int i = 0;
+#ifdef __SSE2__
+    __m128i first = _mm_set1_epi8(pattern[0]);
+    __m128i tail = _mm_set1_epi8(pattern[k - 1]);
+    for (; i + k - 1 + 16 <= length; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(name + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(name + i + k - 1));
+        if (fold)
+        {
+            a = fold_block(a);
+            b = fold_block(b);
+        }
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, tail)));
+        while (mask != 0)
+        {
+            int position = i + __builtin_ctz(mask);
+            if (bytes_equal(name + position + 1, pattern + 1, k - 2, fold))  return 1;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; i <= last; i++)
+    {
+        if (bytes_equal(name + i, pattern, k, fold))  return 1;
+    }
+    return 0;
+}
+
+
+/* байты pattern по порядку, между ними - что угодно */
+int match_fuzzy(const char *name, int length, const char *pattern, int k, int fold)
+{
+    int position = 0;
+    for (int j = 0; j < k; j++)
+    {
+        position = find_byte(name, position, length, pattern[j], fold);
+        if (position < 0)  return 0;
+        position++;
+    }
+    return 1;
+}
+
+
+/* снимаем фильтр; курсор остаётся на той же записи */
+void filter_clear()
+{
+    int entry = cursor_entry();
+    filter.editing = 0;
+    filter.length = 0;
+    filter.pattern[0] = 0;
+    filter.generation++;
+    if (entry >= 0)  cursor_to_entry(entry);
+}
+
+
+/* оставляем из source[0, count) записи, подходящие под фильтр.
+source - order или сами filter.matches, когда набор только сужается */
+void filter_select(const unsigned int *source, int count)
+{
+    if ((unsigned int)count > filter.capacity)
+    {
+        unsigned int *tmp = realloc(filter.matches, count * sizeof(unsigned int));
+        if (tmp == NULL)
+        {
+            /* без памяти под совпадения показываем весь список */
+            wprintf(L"\e[%d;1HНе удалось выделить память для фильтра.", rows);
+            filter_clear();
+            return;
+        }
+        filter.matches = tmp;
+        filter.capacity = count;
+    }
+
+    unsigned long long traced = trace_begin();
+    int fold = filter.mode & FILTER_IGNORE_CASE;
+    int k = filter.length;
+    char pattern[NAME_MAX + 1];
+    for (int j = 0; j < k; j++)
+    {
+        pattern[j] = fold ? fold_ascii(filter.pattern[j]) : filter.pattern[j];
+    }
+
+    int kept = 0;
+    for (int i = 0; i < count; i++)
+    {
+        const char *name = files[source[i]].real_name;
+        int length = strlen(name);
+        int match = (filter.mode & FILTER_FUZZY) ? match_fuzzy(name, length, pattern, k, fold)
+                  : (k <= length && match_substring(name, length, pattern, k, fold));
+        if (match)  filter.matches[kept++] = source[i];
+    }
+    filter.count = kept;
+    filter.generation++;
+    trace_end("filter", traced, "%d -> %d", count, kept);
+}
+
+
+/* список изменился - подбираем совпадения заново по всему order */
+void filter_apply()
+{
+    if (filter.length > 0)  filter_select(order, file_counter);
+}
+
+
+/* строка фильтра или режим изменились: more = 1 - совпадений может стать
+только меньше, ищем среди прежних (если они были). Курсор - на первое совпадение */
+void filter_changed(int more)
+{
+    int narrow = more && filter.length > 1;
+    if (filter.length == 0)  filter.generation++;
+    else if (narrow)         filter_select(filter.matches, filter.count);
+    else                     filter_select(order, file_counter);
+    cursor_pos = 0;
+    scroll_pos = 0;
+}
+
+
+/* клавиша в режиме ввода фильтра; 0 - клавиша не для фильтра */
+int filter_input(char input)
+{
+    switch (input)
+    {
+        case '\n':  /* фильтр остаётся, клавиши снова управляют таблицей */
+            filter.editing = 0;
+            return 1;
+
+        case 127:  /* Backspace: убираем последний символ целиком, с байтами продолжения */
+        case 8:
+            while (filter.length > 0 && ((unsigned char)filter.pattern[--filter.length] & 0xc0) == 0x80);
+            filter.pattern[filter.length] = 0;
+            filter_changed(0);
+            return 1;
+
+        case '\t':  /* учёт регистра */
+            filter.mode ^= FILTER_IGNORE_CASE;
+            filter_changed(!(filter.mode & FILTER_IGNORE_CASE));
+            return 1;
+
+        case 6:  /* ctrl + f - нечёткий поиск */
+            filter.mode ^= FILTER_FUZZY;
+            filter_changed(!(filter.mode & FILTER_FUZZY));
+            return 1;
+    }
+
+    if ((unsigned char)input < 0x20 || filter.length >= NAME_MAX)  return 0;
+    filter.pattern[filter.length++] = input;
+    filter.pattern[filter.length] = 0;
+    filter_changed(1);
+    return 1;
+}
+
+
+/* постепенная загрузка каталога для терминала: поток публикует имена порциями,
+затем пакетами получает атрибуты. Данные списка меняются только под listing_lock */
+pthread_mutex_t listing_lock = PTHREAD_MUTEX_INITIALIZER;
+int wake_pipe[2] = {-1, -1};  /* загрузчик будит главный цикл записью байта */
+
+#define LOAD_FIRST_BATCH  256     /* первая порция - примерно экран, чтобы показать его сразу */
+#define LOAD_PUBLISH_NS   100000000L  /* дальше публикуем не чаще раза в 100 мс */
+#define LOAD_STAT_BATCH   256
+
+struct loader
+{
+    pthread_t thread;
+    int running;           /* поток запущен и ещё не присоединён */
+    int cancel;            /* просьба завершиться, читается без блокировки */
+    int dir_fd;
+    int loading;           /* 1 - загрузка не закончена */
+    unsigned int listed;   /* прочитано имён */
+    unsigned int stated;   /* получено атрибутов */
+};
+
+struct loader loader = { .dir_fd = -1 };
+int cursor_moved = 0;  /* пользователь двигал курсор во время загрузки */
+
+
+void wake_main_loop()
+{
+    if (wake_pipe[1] != -1)
+    {
+        char byte = 0;
+        if (write(wake_pipe[1], &byte, 1) == -1)  { /* канал полон - главный цикл и так проснётся */ }
+    }
+}
+
+
+long elapsed_ns(struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000000000L + (now.tv_nsec - since->tv_nsec);
+}
+
+
+/* курсор на ту же запись после пересортировки; entry < 0 - остаётся на строке.
+Вызывается под listing_lock */
+
+void relocate_cursor(int entry)
+{
+    filter_apply();
+    if (loader.loading && !cursor_moved)
+    {
+        cursor_pos = 0;
+        scroll_pos = 0;
+        return;
+    }
+    if (entry >= 0)  cursor_to_entry(entry);
+}
+
+
+/* сортировка по выбранному столбцу: перестановки запоминаются в sort_cache до смены
+listing_generation, большой список сортирует отдельный поток по копии ключей */
+
+#define SORT_MODES           (2 * SORT_DESCENDING)
+#define SORT_BACKGROUND_MIN  50000  /* меньшие списки сортируем сразу */
+
+struct sort_cache_entry
+{
+    unsigned int *order;
+    unsigned int generation;  /* listing_generation, для которого order верен; 0 - нет */
+};
+
+struct sort_cache_entry sort_cache[SORT_MODES];
+int order_stale = 0;               /* атрибуты изменились, order по столбцу атрибутов устарел */
+unsigned int order_generation = 1; /* меняется при каждой смене order целиком */
+
+struct sorter
+{
+    pthread_t thread;
+    int running;
+    int stop;
+    pthread_cond_t wake;
+};
+
+struct sorter sorter = { .wake = PTHREAD_COND_INITIALIZER };
+
+
+/* order - верный для order_sort - кладём в кэш и ставим на его место new_order.
+Курсор остаётся на той же записи. Вызывается под listing_lock */
+void install_order(unsigned int *new_order, int mode)
+{
+    int entry = cursor_entry();
+
+    struct sort_cache_entry *saved = &sort_cache[order_sort];
+    free(saved->order);
+    saved->order = order;
+    saved->generation = order_stale ? 0 : listing_generation;
+
+    order = new_order;
+    order_sort = mode;
+    order_stale = 0;
+    order_generation++;
+    relocate_cursor(entry);
+}
+
+
+/* нужен ли order в порядке sort_mode. Вызывается под listing_lock */
+int sort_pending()
+{
+    return sort_mode != order_sort || order_stale;
+}
+
+
+void *sorter_main(void *arg)
+{
+    (void)arg;
+    trace_thread_name("sorter");
+
+    pthread_mutex_lock(&listing_lock);
+    while (!sorter.stop)
+    {
+        /* пока загрузчик публикует записи, поколение меняется с каждой
+        порцией и готовый порядок всё равно был бы выброшен; догрузившийся
+        список загрузчик досортирует сам или разбудит нас */
+        if (!sort_pending() || loader.loading)
+        {
+            pthread_cond_wait(&sorter.wake, &listing_lock);
+            continue;
+        }
+
+        /* копия ключей: арена может переехать, пока мы сортируем без блокировки */
+        int mode = sort_mode;
+        unsigned int generation = listing_generation;
+        unsigned int count = file_counter;
+        size_t names_size = 0;
+        for (unsigned int i = 0; i < count; i++)
+        {
+            names_size += strlen(files[i].real_name) + 1;
+        }
+
+        struct sort_key *keys = malloc((count > 0 ? count : 1) * sizeof(struct sort_key));
+        char *names = malloc(names_size > 0 ? names_size : 1);
+        unsigned int *new_order = malloc((count > 0 ? count : 1) * sizeof(unsigned int));
+        if (keys == NULL || names == NULL || new_order == NULL)
+        {
+            /* без памяти остаёмся при старом порядке */
+            free(keys);
+            free(names);
+            free(new_order);
+            sort_mode = order_sort;
+            order_stale = 0;
+            wake_main_loop();
+            continue;
+        }
+
+        char *name = names;
+        for (unsigned int i = 0; i < count; i++)
+        {
+            make_sort_key(&files[i], i, mode, &keys[i]);
+            size_t length = strlen(files[i].real_name) + 1;
+            memcpy(name, files[i].real_name, length);
+            keys[i].name = name;
+            name += length;
+        }
+        pthread_mutex_unlock(&listing_lock);
+
+        unsigned long long start = stats_begin();
+        unsigned long long traced = trace_begin();
+        qsort(keys, count, sizeof(struct sort_key), compare);
+        for (unsigned int i = 0; i < count; i++)
+        {
+            new_order[i] = keys[i].index;
+        }
+        stats_end(PHASE_SORT, start);
+        trace_end("sort background", traced, "%u", count);
+        free(keys);
+        free(names);
+
+        pthread_mutex_lock(&listing_lock);
+        if (generation == listing_generation && mode == sort_mode)
+        {
+            install_order(new_order, mode);
+            wake_main_loop();
+        }
+        else
+        {
+            free(new_order);  /* список или выбор изменились - следующий круг */
+        }
+    }
+    pthread_mutex_unlock(&listing_lock);
+    trace_thread_end();
+    return NULL;
+}
+
+
+/* приводим order к sort_mode: из кэша, сразу или в фоне.
+Вызывается под listing_lock */
+void sort_request()
+{
+    if (!sort_pending())  return;
+
+    struct sort_cache_entry *cached = &sort_cache[sort_mode];
+    if (!order_stale && cached->order != NULL && cached->generation == listing_generation)
+    {
+        unsigned int *new_order = cached->order;
+        cached->order = NULL;
+        cached->generation = 0;
+        install_order(new_order, sort_mode);
+        return;
+    }
+
+    if (file_counter < SORT_BACKGROUND_MIN)
+    {
+        unsigned int *new_order = cached->order;  /* старый массив пригодится как буфер */
+        cached->order = NULL;
+        cached->generation = 0;
+        if (sort(files, file_counter, &new_order, sort_mode) != 0)
+        {
+            free(new_order);
+            wprintf(L"\e[%d;1HНе удалось выделить память для сортировки.", rows);
+            sort_mode = order_sort;
+            return;
+        }
+        install_order(new_order, sort_mode);
+        return;
+    }
+
+    if (!sorter.running)
+    {
+        if (pthread_create(&sorter.thread, NULL, sorter_main, NULL) != 0)
+        {
+            wprintf(L"\e[%d;1HНе удалось запустить поток сортировки.", rows);
+            sort_mode = order_sort;
+            return;
+        }
+        sorter.running = 1;
+    }
+    pthread_cond_signal(&sorter.wake);
+}
+
+
+/* список сменился: запомненные порядки больше не нужны. Вызывается под listing_lock */
+void sort_cache_clear()
+{
+    for (int i = 0; i < SORT_MODES; i++)
+    {
+        free(sort_cache[i].order);
+        sort_cache[i].order = NULL;
+        sort_cache[i].generation = 0;
+    }
+}
+
+
+/* останавливаем поток сортировки перед выходом. Вызывается под listing_lock */
+void stop_sorter()
+{
+    if (!sorter.running)  return;
+    sorter.stop = 1;
+    pthread_cond_signal(&sorter.wake);
+    pthread_mutex_unlock(&listing_lock);
+    pthread_join(sorter.thread, NULL);
+    pthread_mutex_lock(&listing_lock);
+    sorter.running = 0;
+    sort_cache_clear();
+}
+
+
+/* публикуем прочитанные имена: добавляем в арену и вливаем в порядок сортировки */
+int loader_publish(struct file_info *batch, unsigned int count)
+{
+    pthread_mutex_lock(&listing_lock);
+    if (__atomic_load_n(&loader.cancel, __ATOMIC_ACQUIRE))
+    {
+        pthread_mutex_unlock(&listing_lock);
+        return -1;
+    }
+
+    int entry = cursor_entry();
+    unsigned int old_count = listing_arena.used;
+    for (unsigned int i = 0; i < count; i++)
+    {
+        struct file_info *file = arena_reserve(&listing_arena);
+        if (file == NULL)  break;
+        *file = batch[i];
+        arena_commit(&listing_arena);
+    }
+
+    files = listing_arena.data;
+    int result = sort_merge(files, old_count, listing_arena.used - old_count, &order, order_sort);
+    if (result == 0)
+    {
+        file_counter = listing_arena.used;
+        loader.listed = file_counter;
+        relocate_cursor(entry);
+    }
+    else
+    {
+        arena_release(&listing_arena, old_count);
+    }
+
+    invalidate_rows();
+    pthread_mutex_unlock(&listing_lock);
+    wake_main_loop();
+    return result;
+}
+
+
+/* первая фаза: имена и типы из d_type */
+int loader_read_names(DIR *dir)
+{
+    unsigned int capacity = LOAD_FIRST_BATCH;
+    unsigned int count = 0;
+    struct file_info *batch = malloc(capacity * sizeof(struct file_info));
+    if (batch == NULL)  return -1;
+
+    struct timespec last_publish;
+    clock_gettime(CLOCK_MONOTONIC, &last_publish);
+    int published = 0;
+
+    while (!__atomic_load_n(&loader.cancel, __ATOMIC_ACQUIRE))
+    {
+        unsigned long long started = stats_begin();
+        errno = 0;
+        struct dirent *rd = readdir(dir);
+        stats_end(PHASE_READDIR, started);
+        stats_add(STAT_READDIR, 1);
+        if (rd == NULL)  break;
+
+        if (strcmp(rd->d_name, ".") == 0 || strcmp(rd->d_name, "..") == 0)
+            continue;
+
+        if (count == capacity)
+        {
+            struct file_info *tmp = realloc(batch, capacity * 2 * sizeof(struct file_info));
+            if (tmp == NULL)  break;
+            batch = tmp;
+            capacity *= 2;
+        }
+
+        struct file_info *file = &batch[count++];
+        memset(file, 0, offsetof(struct file_info, real_name));
+        file->mode = dtype_to_mode(rd->d_type);
+        file->pending = 1;
+        strcpy(file->real_name, rd->d_name);
+        stats_add(STAT_ENTRIES, 1);
+
+        /* первый экран показываем сразу, дальше - не чаще LOAD_PUBLISH_NS */
+        if ((!published && count >= LOAD_FIRST_BATCH) || (published && elapsed_ns(&last_publish) >= LOAD_PUBLISH_NS))
+        {
+            if (loader_publish(batch, count) != 0)
+            {
+                free(batch);
+                return -1;
+            }
+            count = 0;
+            published = 1;
+            clock_gettime(CLOCK_MONOTONIC, &last_publish);
+        }
+    }
+
+    int result = 0;
+    if (count > 0 || !published)  result = loader_publish(batch, count);
+    free(batch);
+    return result;
+}
+
+
+/* вторая фаза: атрибуты пакетами по LOAD_STAT_BATCH записей.
+Имена больше не добавляются, поэтому индексы записей в арене постоянны */
+void loader_read_attributes()
+{
+    struct file_info batch[LOAD_STAT_BATCH];
+    struct out_buf messages = { .fd = -1 };  /* сообщения о stat не должны портить экран */
+    scan_out = &messages;
+
+    pthread_mutex_lock(&listing_lock);
+    unsigned int count = listing_arena.used;
+    pthread_mutex_unlock(&listing_lock);
+
+    int resort = 0;
+    int failed = 0;
+    struct timespec last_wake;
+    clock_gettime(CLOCK_MONOTONIC, &last_wake);
+
+    for (unsigned int start = 0; start < count; start += LOAD_STAT_BATCH)
+    {
+        if (__atomic_load_n(&loader.cancel, __ATOMIC_ACQUIRE))  break;
+
+        unsigned int size = (count - start < LOAD_STAT_BATCH) ? count - start : LOAD_STAT_BATCH;
+
+        pthread_mutex_lock(&listing_lock);
+        memcpy(batch, listing_arena.data + start, size * sizeof(struct file_info));
+        pthread_mutex_unlock(&listing_lock);
+
+        for (unsigned int i = 0; i < size; i++)
+        {
+            batch[i].mode = 0;
+        }
+
+        if (scan_flags & SCAN_STATX_BATCH)
+        {
+            stat_entries(loader.dir_fd, batch, size);
+        }
+        else
+        {
+            unsigned long long traced = trace_begin();
+            for (unsigned int i = 0; i < size; i++)
+            {
+                stat_entry(loader.dir_fd, &batch[i]);
+            }
+            trace_end("stat batch", traced, "%u", size);
+        }
+        out_free(&messages);
+
+        pthread_mutex_lock(&listing_lock);
+        for (unsigned int i = 0; i < size; i++)
+        {
+            struct file_info *file = &listing_arena.data[start + i];
+            if (batch[i].mode == 0)
+            {
+                failed = 1;  /* как и раньше, объект без stat в список не попадает */
+                file->mode = 0;
+                continue;
+            }
+            if (S_ISDIR(batch[i].mode) != S_ISDIR(file->mode))  resort = 1;
+            *file = batch[i];
+            file->pending = 0;
+        }
+        loader.stated = start + size;
+        invalidate_rows();
+        pthread_mutex_unlock(&listing_lock);
+
+        if (elapsed_ns(&last_wake) >= LOAD_PUBLISH_NS / 2)
+        {
+            wake_main_loop();
+            clock_gettime(CLOCK_MONOTONIC, &last_wake);
+        }
+    }
+
+    pthread_mutex_lock(&listing_lock);
+    if (!__atomic_load_n(&loader.cancel, __ATOMIC_ACQUIRE) && (failed || resort))
+    {
+        int entry = cursor_entry();
+
+        /* убираем записи без stat, сохраняя порядок, и сортируем заново */
+        unsigned int shown = file_counter;  /* под столько записей order уже выделен */
+        unsigned int kept = 0;
+        for (unsigned int i = 0; i < listing_arena.used; i++)
+        {
+            if (listing_arena.data[i].mode == 0)
+            {
+                if ((int)i == entry)  entry = -1;
+                continue;
+            }
+            if ((int)i == entry)  entry = kept;
+            if (kept != i)  listing_arena.data[kept] = listing_arena.data[i];
+            kept++;
+        }
+        arena_release(&listing_arena, kept);
+        file_counter = kept;
+        if (sort(files, file_counter, &order, order_sort) != 0)
+        {
+            /* без памяти на сортировку оставляем порядок каталога */
+            unsigned int *tmp = realloc(order, (kept > 0 ? kept : 1) * sizeof(unsigned int));
+            if (tmp != NULL)  order = tmp;
+            else if (file_counter > shown)  file_counter = shown;
+            for (unsigned int i = 0; i < file_counter; i++)
+            {
+                order[i] = i;
+            }
+        }
+        relocate_cursor(entry);
+        invalidate_rows();
+    }
+    else if (!__atomic_load_n(&loader.cancel, __ATOMIC_ACQUIRE) && SORT_COLUMN(order_sort) != SORT_NAME)
+    {
+        /* порядок строился по пустым атрибутам */
+        order_stale = 1;
+        sort_request();
+    }
+    pthread_mutex_unlock(&listing_lock);
+
+    scan_out = NULL;
+    out_free(&messages);
+    uring_free(&stat_ring);
+}
+
+
+void *loader_main(void *arg)
+{
+    (void)arg;
+    trace_thread_name("loader");
+
+    int fd = dup(loader.dir_fd);
+    DIR *dir = (fd != -1) ? fdopendir(fd) : NULL;
+    if (dir == NULL)
+    {
+        if (fd != -1)  close(fd);
+    }
+    else
+    {
+        stats_add(STAT_DIRS, 1);
+        unsigned long long traced = trace_begin();
+        int result = loader_read_names(dir);
+        trace_end("readdir", traced, "%u", loader.listed);
+        if (result == 0)  loader_read_attributes();
+        closedir(dir);
+    }
+
+    pthread_mutex_lock(&listing_lock);
+    loader.loading = 0;
+    if (sorter.running && sort_pending())  pthread_cond_signal(&sorter.wake);
+    pthread_mutex_unlock(&listing_lock);
+    wake_main_loop();
+    trace_thread_end();
+    return NULL;
+}
+
+
+/* останавливаем загрузчик. Вызывается под listing_lock:
+на время ожидания потока блокировку отпускаем, иначе он не сможет выйти.
+Дескриптор каталога остаётся открытым - по нему живое обновление и кэш */
+void stop_loading()
+{
+    if (loader.running)
+    {
+        __atomic_store_n(&loader.cancel, 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&listing_lock);
+        pthread_join(loader.thread, NULL);
+        pthread_mutex_lock(&listing_lock);
+        loader.running = 0;
+    }
+    loader.loading = 0;
+}
+
+
+/* живое обновление списка через inotify: события только отмечают имена,
+раз в WATCH_REFRESH_NS отмеченные проверяются fstatat одним обновлением */
+#define WATCH_EVENTS     (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_MODIFY | IN_ONLYDIR)
+#define WATCH_REFRESH_NS 100000000L  /* не больше 10 обновлений в секунду */
+#define WATCH_MAX_DIRTY  16384       /* больше изменённых имён - проще перечитать каталог */
+
+struct watch
+{
+    int fd;                   /* inotify, -1 - живое обновление недоступно */
+    int wd;                   /* наблюдение за текущим каталогом */
+    struct file_info *dirty;  /* изменённые имена, атрибуты заполняются при обновлении */
+    unsigned int count;
+    unsigned int capacity;
+    unsigned int *slots;      /* хэш имён: индекс в dirty + 1, 0 - пусто */
+    unsigned int slot_mask;
+    int overflow;             /* события потеряны - нужно перечитать каталог целиком */
+    struct timespec last_refresh;
+};
+
+struct watch watch = { .fd = -1, .wd = -1 };
+
+
+unsigned int name_hash(const char *name)
+{
+    unsigned int hash = 2166136261u;  /* FNV-1a */
+    for (; *name != 0; name++)
+    {
+        hash = (hash ^ (unsigned char)*name) * 16777619u;
+    }
+    return hash;
+}
+
+
+/* слот имени в хэше изменённых имён: либо с этим именем, либо пустой */
+unsigned int *watch_slot(const char *name)
+{
+    unsigned int i = name_hash(name) & watch.slot_mask;
+    while (watch.slots[i] != 0 && strcmp(watch.dirty[watch.slots[i] - 1].real_name, name) != 0)
+    {
+        i = (i + 1) & watch.slot_mask;
+    }
+    return &watch.slots[i];
+}
+
+
+void watch_clear()
+{
+    if (watch.slots != NULL)  memset(watch.slots, 0, (watch.slot_mask + 1) * sizeof(unsigned int));
+    watch.count = 0;
+    watch.overflow = 0;
+}
+
+
+void watch_mark(const char *name)
+{
+    if (watch.overflow)  return;
+    if (watch.count == WATCH_MAX_DIRTY)
+    {
+        watch.overflow = 1;
+        return;
+    }
+
+    if (watch.slots == NULL)
+    {
+        /* хэш заполнен не больше чем наполовину */
+        watch.slots = calloc(2 * WATCH_MAX_DIRTY, sizeof(unsigned int));
+        if (watch.slots == NULL)
+        {
+            watch.overflow = 1;
+            return;
+        }
+        watch.slot_mask = 2 * WATCH_MAX_DIRTY - 1;
+    }
+
+    unsigned int *slot = watch_slot(name);
+    if (*slot != 0)  return;  /* имя уже отмечено */
+
+    if (watch.count == watch.capacity)
+    {
+        unsigned int capacity = watch.capacity ? watch.capacity * 2 : 64;
+        struct file_info *tmp = realloc(watch.dirty, capacity * sizeof(struct file_info));
+        if (tmp == NULL)
+        {
+            watch.overflow = 1;
+            return;
+        }
+        watch.dirty = tmp;
+        watch.capacity = capacity;
+    }
+
+    strcpy(watch.dirty[watch.count].real_name, name);
+    *slot = ++watch.count;
+}
+
+
+/* начинаем следить за новым каталогом. Вызывается до чтения каталога,
+чтобы изменения во время загрузки не потерялись */
+void watch_directory(char *path)
+{
+    if (watch.fd == -1)  return;
+
+    if (watch.wd != -1)  inotify_rm_watch(watch.fd, watch.wd);
+    watch.wd = inotify_add_watch(watch.fd, path, WATCH_EVENTS);
+    watch_clear();
+}
+
+
+/* забираем все накопившиеся события, отмечая изменённые имена */
+void watch_read_events()
+{
+    char buffer[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (1)
+    {
+        ssize_t size = read(watch.fd, buffer, sizeof(buffer));
+        if (size <= 0)  break;
+
+        for (char *ptr = buffer; ptr < buffer + size; )
+        {
+            struct inotify_event *event = (struct inotify_event *)ptr;
+            ptr += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW)  watch.overflow = 1;
+            /* события от каталога, из которого уже ушли, не нужны */
+            if (event->wd != watch.wd || event->len == 0)  continue;
+            watch_mark(event->name);
+        }
+    }
+}
+
+
+/* через сколько миллисекунд можно обновлять список, -1 - нечего обновлять.
+Пока идёт загрузка, имена копятся: загрузчик разбудит цикл по окончании.
+Вызывается под listing_lock */
+int watch_timeout()
+{
+    if ((watch.count == 0 && !watch.overflow) || loader.loading)  return -1;
+
+    long left = WATCH_REFRESH_NS - elapsed_ns(&watch.last_refresh);
+    return left > 0 ? (int)((left + 999999) / 1000000) : 0;
+}
+
+
+/* положение просмотра каталога: его запоминаем вместе со списком */
+struct view_state
+{
+    int cursor_pos;
+    int scroll_pos;
+    int path_scroll;
+    int active_column;
+    int column_scrolls[TABLE_COLUMNS];
+};
+
+
+void save_view(struct view_state *view)
+{
+    view->cursor_pos = cursor_pos;
+    view->scroll_pos = scroll_pos;
+    view->path_scroll = path_scroll;
+    view->active_column = active_column;
+    memcpy(view->column_scrolls, column_scrolls, sizeof(column_scrolls));
+}
+
+
+void restore_view(const struct view_state *view)
+{
+    cursor_pos = view->cursor_pos;
+    scroll_pos = view->scroll_pos;
+    path_scroll = view->path_scroll;
+    active_column = view->active_column;
+    memcpy(column_scrolls, view->column_scrolls, sizeof(column_scrolls));
+}
+
+
+/* LRU-кэш списков по (st_dev, st_ino), годен при тех же mtime и ctime.
+Арена и перестановка переходят из кэша в список без копирования */
+#define LISTING_CACHE_SLOTS 32
+#define LISTING_CACHE_RACY_NS 1000000000L  /* каталог, изменённый позже, не кэшируем */
+
+struct listing_cache_entry
+{
+    int used;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtim;
+    struct timespec ctim;
+    struct file_arena arena;
+    unsigned int *order;
+    int sort;                 /* порядок, в котором отсортирован order */
+    struct view_state view;
+    size_t bytes;
+    unsigned long long last_used;
+};
+
+struct listing_cache_entry listing_cache[LISTING_CACHE_SLOTS];
+size_t listing_cache_bytes = 0;
+size_t listing_cache_limit = 128u << 20;  /* потолок памяти, задаётся --cache */
+unsigned long long listing_cache_clock = 0;
+
+
+void listing_cache_drop(struct listing_cache_entry *entry)
+{
+    arena_free(&entry->arena);
+    free(entry->order);
+    listing_cache_bytes -= entry->bytes;
+    entry->used = 0;
+}
+
+
+/* запоминаем полный и актуальный список перед уходом из каталога; каталог,
+менявшийся в последнюю секунду, не кэшируем. Вызывается под listing_lock */
+
+void listing_cache_store(int complete)
+{
+    if (listing_cache_limit == 0 || !complete || order_stale || loader.dir_fd == -1)  return;
+
+    struct stat st;
+    if (fstat(loader.dir_fd, &st) == -1)  return;
+
+    /* события до fstat уже в очереди inotify: если их нет, список соответствует mtime */
+    if (watch.fd != -1)  watch_read_events();
+    if (watch.fd == -1 || watch.count != 0 || watch.overflow)  return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    const struct timespec *times[2] = { &st.st_mtim, &st.st_ctim };
+    for (int i = 0; i < 2; i++)
+    {
+        long long age = (now.tv_sec - times[i]->tv_sec) * 1000000000LL + (now.tv_nsec - times[i]->tv_nsec);
+        if (age < LISTING_CACHE_RACY_NS)  return;
+    }
+
+    size_t bytes = (size_t)listing_arena.capacity * sizeof(struct file_info)
+                 + (size_t)file_counter * sizeof(unsigned int);
+    if (bytes > listing_cache_limit)  return;
+
+    /* старый список того же каталога и самые давние - вон, пока не влезем */
+    struct listing_cache_entry *slot = NULL;
+    for (int i = 0; i < LISTING_CACHE_SLOTS; i++)
+    {
+        if (listing_cache[i].used && listing_cache[i].dev == st.st_dev && listing_cache[i].ino == st.st_ino)
+            listing_cache_drop(&listing_cache[i]);
+    }
+    while (1)
+    {
+        struct listing_cache_entry *oldest = NULL;
+        slot = NULL;
+        for (int i = 0; i < LISTING_CACHE_SLOTS; i++)
+        {
+            if (!listing_cache[i].used)
+            {
+                if (slot == NULL)  slot = &listing_cache[i];
+            }
+            else if (oldest == NULL || listing_cache[i].last_used < oldest->last_used)
+            {
+                oldest = &listing_cache[i];
+            }
+        }
+        if (slot != NULL && listing_cache_bytes + bytes <= listing_cache_limit)  break;
+        listing_cache_drop(oldest);
+    }
+
+    slot->used = 1;
+    slot->dev = st.st_dev;
+    slot->ino = st.st_ino;
+    slot->mtim = st.st_mtim;
+    slot->ctim = st.st_ctim;
+    slot->arena = listing_arena;
+    slot->order = order;
+    slot->sort = order_sort;
+    save_view(&slot->view);
+    slot->bytes = bytes;
+    slot->last_used = ++listing_cache_clock;
+    listing_cache_bytes += bytes;
+
+    /* список теперь принадлежит кэшу */
+    memset(&listing_arena, 0, sizeof(listing_arena));
+    order = NULL;
+    files = NULL;
+    file_counter = 0;
+}
+
+
+/* ищем годный список каталога dir_fd и делаем его текущим.
+1 - список взят из кэша. Вызывается под listing_lock */
+int listing_cache_restore(int dir_fd)
+{
+    struct stat st;
+    if (listing_cache_limit == 0 || fstat(dir_fd, &st) == -1)  return 0;
+
+    for (int i = 0; i < LISTING_CACHE_SLOTS; i++)
+    {
+        struct listing_cache_entry *entry = &listing_cache[i];
+        if (!entry->used || entry->dev != st.st_dev || entry->ino != st.st_ino)  continue;
+
+        if (entry->mtim.tv_sec != st.st_mtim.tv_sec || entry->mtim.tv_nsec != st.st_mtim.tv_nsec
+            || entry->ctim.tv_sec != st.st_ctim.tv_sec || entry->ctim.tv_nsec != st.st_ctim.tv_nsec)
+        {
+            /* каталог изменился - список устарел */
+            listing_cache_drop(entry);
+            return 0;
+        }
+
+        arena_free(&listing_arena);
+        free(order);
+        listing_arena = entry->arena;
+        order = entry->order;
+        order_sort = entry->sort;
+        files = listing_arena.data;
+        file_counter = listing_arena.used;
+        restore_view(&entry->view);
+
+        listing_cache_bytes -= entry->bytes;
+        entry->used = 0;
+        return 1;
+    }
+    return 0;
+}
+
+
+void listing_cache_free()
+{
+    for (int i = 0; i < LISTING_CACHE_SLOTS; i++)
+    {
+        if (listing_cache[i].used)  listing_cache_drop(&listing_cache[i]);
+    }
+}
+
+
+/* снимок дерева (-S FILE), просматривается через mmap (-o FILE). Файл: заголовок,
+узлы фиксированного размера (узел 0 - корень с полным путём, дети каталога подряд
+после него в порядке SORT_NAME), пул имён. Порядок байт - машины, снявшей снимок */
+#define SNAPSHOT_MAGIC "FMSNAP2\n"
+
+struct snapshot_header
+{
+    char magic[8];
+    unsigned int node_size;        /* sizeof(struct snapshot_node) - проверка совместимости */
+    unsigned int node_count;
+    unsigned long long nodes_offset;
+    unsigned long long names_offset;
+    unsigned long long names_size;
+    long long created_ns;          /* CLOCK_REALTIME окончания обхода */
+};
+
+/* каталог на момент чтения: по (ino, mtime, ctime) повторный обход (-i)
+решает, можно ли взять его детей из снимка, не читая каталог */
+struct snapshot_dir
+{
+    unsigned int first_child;
+    unsigned int child_count;
+    unsigned long long ino;
+    long long mtime_ns;            /* 0 - каталог менялся во время чтения, перечитать */
+    long long ctime_ns;
+};
+
+struct snapshot_node
+{
+    unsigned long long name;       /* смещение имени в пуле */
+    unsigned int parent;
+    unsigned int mode;
+    unsigned int uid;
+    unsigned int gid;
+    long long mtime_ns;
+    long long atime_ns;
+    struct snapshot_dir dir;       /* только у прочитанных каталогов, у остальных нули */
+};
+
+/* открытый снимок */
+struct snapshot
+{
+    char *data;
+    size_t size;
+    int fd;                 /* открыт, пока отображён: по нему проверяем, не укоротили ли файл */
+    const struct snapshot_node *nodes;
+    const char *names;
+    unsigned int node_count;
+    unsigned long long names_size;
+    unsigned int current;   /* узел каталога, который показан */
+    unsigned int first;     /* files[i] - узел first + i */
+};
+
+struct snapshot snapshot;   /* просматриваемый (-o); data == NULL - живая файловая система */
+struct snapshot previous;   /* предыдущий для повторного обхода (-i) */
+char *snapshot_open_path = NULL;  /* -o: просматривать снимок */
+
+
+/* отображаем снимок в память; узлы и имена проверяются при чтении каталога.
+Файл, укороченный извне, ловит snapshot_check перед переходом */
+int snapshot_open(struct snapshot *snap, char *file_path)
+{
+    int fd = open(file_path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        if (fd != -1)  close(fd);
+        return -1;
+    }
+
+    const struct snapshot_header *header = NULL;
+    void *data = MAP_FAILED;
+    if ((size_t)st.st_size >= sizeof(struct snapshot_header))
+    {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    if (data == MAP_FAILED)
+    {
+        close(fd);
+        return -1;
+    }
+    header = data;
+
+    /* узлы и имена должны целиком лежать в файле, имя корня - заканчиваться нулём */
+    unsigned long long size = st.st_size;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, 8) != 0 || header->node_size != sizeof(struct snapshot_node)
+        || header->node_count == 0 || header->nodes_offset % 8 != 0 || header->nodes_offset > size
+        || (size - header->nodes_offset) / sizeof(struct snapshot_node) < header->node_count
+        || header->names_offset > size || header->names_size > size - header->names_offset
+        || header->names_size == 0 || ((char *)data)[header->names_offset + header->names_size - 1] != 0)
+    {
+        munmap(data, st.st_size);
+        close(fd);
+        return -1;
+    }
+
+    snap->data = data;
+    snap->size = st.st_size;
+    snap->fd = fd;
+    snap->nodes = (const struct snapshot_node *)(snap->data + header->nodes_offset);
+    snap->names = snap->data + header->names_offset;
+    snap->node_count = header->node_count;
+    snap->names_size = header->names_size;
+    snap->current = 0;
+    return 0;
+}
+
+
+void snapshot_close(struct snapshot *snap)
+{
+    if (snap->data != NULL)
+    {
+        munmap(snap->data, snap->size);
+        close(snap->fd);
+    }
+    snap->data = NULL;
+}
+
+
+/* файл снимка не короче, чем при открытии */
+int snapshot_intact(const struct snapshot *snap)
+{
+    struct stat st;
+    return fstat(snap->fd, &st) == 0 && (unsigned long long)st.st_size >= snap->size;
+}
+
+
+/* имя узла или NULL, если смещение вне пула */
+const char *snapshot_name(const struct snapshot *snap, unsigned int index)
+{
+    unsigned long long name = snap->nodes[index].name;
+    return name < snap->names_size ? snap->names + name : NULL;
+}
+
+
+/* дети каталога index: их число, первый - в *first. Диапазон вне снимка
+или не после самого каталога (так снимок не пишется) считаем пустым */
+unsigned int snapshot_children(const struct snapshot *snap, unsigned int index, unsigned int *first)
+{
+    const struct snapshot_dir *dir = &snap->nodes[index].dir;
+    *first = dir->first_child;
+    if (dir->first_child <= index || dir->first_child > snap->node_count
+        || dir->child_count > snap->node_count - dir->first_child)
+    {
+        return 0;
+    }
+    return dir->child_count;
+}
+
+
+/* запись списка из узла снимка */
+void snapshot_file_info(const struct snapshot *snap, unsigned int index, struct file_info *file)
+{
+    const struct snapshot_node *node = &snap->nodes[index];
+    const char *name = snapshot_name(snap, index);
+    file->mode = node->mode;
+    file->uid = node->uid;
+    file->gid = node->gid;
+    file->mtim.tv_sec = node->mtime_ns / 1000000000;
+    file->mtim.tv_nsec = node->mtime_ns % 1000000000;
+    file->atim.tv_sec = node->atime_ns / 1000000000;
+    file->atim.tv_nsec = node->atime_ns % 1000000000;
+    file->size = file->blocks = 0;
+    file->total = DU_UNKNOWN;  /* размеров в снимке нет */
+    file->pending = 0;
+    snprintf(file->real_name, sizeof(file->real_name), "%s", name != NULL ? name : "?");
+}
+
+
+/* путь каталога index: имя корня и имена предков. 0 - путь записан в path */
+int snapshot_path(const struct snapshot *snap, unsigned int index, char *path)
+{
+    unsigned int chain[PATH_MAX / 2];
+    unsigned int depth = 0;
+    while (index != 0)
+    {
+        if (depth == PATH_MAX / 2 || index >= snap->node_count)  return -1;
+        chain[depth++] = index;
+        index = snap->nodes[index].parent;
+    }
+
+    const char *root = snapshot_name(snap, 0);
+    if (root == NULL)  return -1;
+    int length = snprintf(path, PATH_MAX, "%s", root);
+    while (depth > 0 && length < PATH_MAX)
+    {
+        const char *name = snapshot_name(snap, chain[--depth]);
+        if (name == NULL)  return -1;
+        length += snprintf(path + length, PATH_MAX - length, "/%s", name);
+    }
+    return length < PATH_MAX ? 0 : -1;
+}
+
+
+/* список каталога snapshot.current: узлы детей копируются в арену терминала.
+Блок уже лежит в порядке SORT_NAME, так что перестановка - тождественная.
+Вызывается из start_loading под listing_lock */
+int snapshot_load()
+{
+    unsigned long long traced = trace_begin();
+    unsigned int count = snapshot_children(&snapshot, snapshot.current, &snapshot.first);
+
+    arena_release(&listing_arena, 0);
+    unsigned int *tmp = realloc(order, (count > 0 ? count : 1) * sizeof(unsigned int));
+    if (tmp == NULL)  return -8;
+    order = tmp;
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        struct file_info *file = arena_reserve(&listing_arena);
+        if (file == NULL)  break;
+        snapshot_file_info(&snapshot, snapshot.first + i, file);
+        arena_commit(&listing_arena);
+        order[i] = i;
+    }
+
+    files = listing_arena.data;
+    file_counter = listing_arena.used;
+    order_sort = SORT_NAME;
+    filter_apply();
+    sort_request();
+    stats_add(STAT_ENTRIES, file_counter);
+    trace_end("snapshot", traced, "%u", file_counter);
+    return 0;
+}
+
+
+/* суммы каталогов для столбца size, как у du: задача - каталог в общем стеке
+DU_THREADS потоков, законченный отдаёт сумму родителю. Суммы кэшируются по
+(st_dev, st_ino), пока тот же ctime и inotify не видел изменений под каталогом */
+
+#define DU_THREADS     4
+#define DU_PUBLISH_NS  100000000L  /* частичные суммы показываем не чаще раза в 100 мс */
+#define DU_MAX_FDS     64
+
+struct du_cache_entry
+{
+    dev_t dev;
+    ino_t ino;
+    long long ctime_ns;
+    unsigned long long bytes;
+    unsigned long long blocks;
+    int used;
+    int stale;   /* inotify видел изменения в поддереве */
+};
+
+/* открытая адресация, как у inode_set */
+struct du_cache
+{
+    struct du_cache_entry *entries;
+    size_t count;
+    size_t capacity;
+};
+
+/* каталог списка, от которого открываются корни; живёт, пока есть его корни */
+struct du_base
+{
+    int fd;
+    unsigned int refs;           /* под du.lock */
+};
+
+struct du_node
+{
+    struct du_node *parent;      /* NULL у корня */
+    struct du_node *root;
+    struct du_node *next;        /* в стеке задач */
+    char *name;
+    int fd;                      /* открыт, пока читаются подкаталоги; -1 - закрыт */
+    dev_t dev;
+    ino_t ino;
+    long long ctime_ns;
+    /* дальше - под du.lock */
+    unsigned long long bytes;    /* сам каталог, его файлы и законченные подкаталоги */
+    unsigned long long blocks;
+    unsigned int pending;        /* незаконченные подкаталоги и 1 за чтение самого каталога */
+    int incomplete;              /* часть поддерева не прочитана - в кэш не кладём */
+    /* только у корня */
+    struct du_base *base;
+    int recount;                 /* сумма самого корня в кэше могла устареть */
+    int cancelled;               /* список сменился; потоки читают без блокировки */
+    int started;
+    int done;
+    int detached;                /* корень освобождает поток, который его закончит */
+    struct inode_set visited;    /* каталоги поддерева, уже поставленные в подсчёт */
+    unsigned int entry;          /* индекс записи в files; -1 - корень вытеснен тёзкой */
+    unsigned long long partial_bytes;  /* всё, что уже сложено в поддереве */
+    unsigned long long partial_blocks;
+};
+
+struct du
+{
+    pthread_mutex_t lock;        /* стек задач, кэш и суммы узлов */
+    pthread_cond_t wake;
+    pthread_t threads[DU_THREADS];
+    unsigned int threads_running;
+    int stop;
+    struct du_node *tasks;       /* стек: подкаталоги берутся раньше следующих корней */
+    struct du_cache cache;
+    struct du_base *base;        /* каталог текущего списка */
+    unsigned int open_fds;       /* атомарно */
+    struct du_node **roots;      /* корни текущего списка, в обратном порядке строк */
+    unsigned int root_count;
+    unsigned int roots_done;
+    struct du_node **slots;      /* хэш корней по имени, заполнен не больше чем наполовину */
+    unsigned int slot_mask;
+    int added;                   /* под listing_lock: watch_refresh вставил записи */
+    unsigned int listing_id;     /* список, для которого запущен подсчёт; 0 - никакой */
+    int changed;                 /* есть суммы, ещё не перенесённые в строки */
+    struct timespec last_wake;
+};
+
+struct du du = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+
+
+struct du_cache_entry *du_cache_find(struct du_cache *cache, dev_t dev, ino_t ino)
+{
+    size_t hash = (size_t)(ino * 0x9e3779b97f4a7c15ULL) ^ (size_t)dev;
+    size_t i = hash & (cache->capacity - 1);
+    while (cache->entries[i].used && (cache->entries[i].dev != dev || cache->entries[i].ino != ino))
+    {
+        i = (i + 1) & (cache->capacity - 1);
+    }
+    return &cache->entries[i];
+}
+
+
+/* сумма каталога из кэша или NULL. Вызывается под du.lock */
+struct du_cache_entry *du_cache_lookup(const struct du_node *node)
+{
+    if (du.cache.capacity == 0)  return NULL;
+    struct du_cache_entry *entry = du_cache_find(&du.cache, node->dev, node->ino);
+    return (entry->used && !entry->stale && entry->ctime_ns == node->ctime_ns) ? entry : NULL;
+}
+
+
+/* запоминаем сумму законченного каталога; без памяти просто не запоминаем.
+Вызывается под du.lock */
+void du_cache_store(const struct du_node *node)
+{
+    struct du_cache *cache = &du.cache;
+    if (2 * (cache->count + 1) > cache->capacity)
+    {
+        struct du_cache grown = { .capacity = cache->capacity ? cache->capacity * 2 : 256 };
+        grown.entries = calloc(grown.capacity, sizeof(struct du_cache_entry));
+        if (grown.entries == NULL)  return;
+
+        for (size_t i = 0; i < cache->capacity; i++)
+        {
+            if (cache->entries[i].used)  *du_cache_find(&grown, cache->entries[i].dev, cache->entries[i].ino) = cache->entries[i];
+        }
+        grown.count = cache->count;
+        free(cache->entries);
+        *cache = grown;
+    }
+
+    struct du_cache_entry *entry = du_cache_find(cache, node->dev, node->ino);
+    if (!entry->used)  cache->count++;
+    entry->dev = node->dev;
+    entry->ino = node->ino;
+    entry->ctime_ns = node->ctime_ns;
+    entry->bytes = node->bytes;
+    entry->blocks = node->blocks;
+    entry->used = 1;
+    entry->stale = 0;
+}
+
+
+/* в каталоге dir_fd что-то изменилось: суммы его и всех предков в кэше устарели,
+хотя ctime у предков прежний. Их списки в кэше списков несут те же суммы - их
+тоже выбрасываем. Вызывается под listing_lock */
+void du_forget_ancestors(int dir_fd)
+{
+    struct stat st;
+    if (fstat(dir_fd, &st) != 0)  return;
+
+    int fd = dir_fd;
+    while (1)
+    {
+        pthread_mutex_lock(&du.lock);
+        if (du.cache.capacity != 0)
+        {
+            struct du_cache_entry *entry = du_cache_find(&du.cache, st.st_dev, st.st_ino);
+            if (entry->used)  entry->stale = 1;
+        }
+        pthread_mutex_unlock(&du.lock);
+        for (int i = 0; i < LISTING_CACHE_SLOTS; i++)
+        {
+            if (listing_cache[i].used && listing_cache[i].dev == st.st_dev && listing_cache[i].ino == st.st_ino)
+                listing_cache_drop(&listing_cache[i]);
+        }
+
+        struct stat up;
+        int parent = openat(fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd != dir_fd)  close(fd);
+        fd = parent;
+        if (fd == -1)  return;
+        if (fstat(fd, &up) != 0 || (up.st_dev == st.st_dev && up.st_ino == st.st_ino))  break;
+        st = up;
+    }
+    close(fd);
+}
+
+
+void du_node_stat(struct du_node *node, const struct stat *st)
+{
+    node->dev = st->st_dev;
+    node->ino = st->st_ino;
+    node->ctime_ns = time_ns(&st->st_ctim);
+    node->bytes = st->st_size;
+    node->blocks = st->st_blocks;
+}
+
+
+/* задача для подкаталога name каталога parent; st - его stat, у корня - NULL */
+struct du_node *du_node_new(struct du_node *parent, const char *name, const struct stat *st)
+{
+    struct du_node *node = calloc(1, sizeof(struct du_node));
+    if (node != NULL)  node->name = strdup(name);
+    if (node == NULL || node->name == NULL)
+    {
+        free(node);
+        return NULL;
+    }
+    node->fd = -1;
+    node->parent = parent;
+    node->root = (parent != NULL) ? parent->root : node;
+    node->pending = 1;
+    if (st != NULL)  du_node_stat(node, st);
+    return node;
+}
+
+
+void du_node_close(struct du_node *node)
+{
+    if (node->fd == -1)  return;
+    close(node->fd);
+    node->fd = -1;
+    __atomic_sub_fetch(&du.open_fds, 1, __ATOMIC_RELAXED);
+}
+
+
+/* вызывается под du.lock */
+void du_node_free(struct du_node *node)
+{
+    du_node_close(node);
+    if (node->base != NULL && --node->base->refs == 0)
+    {
+        close(node->base->fd);
+        free(node->base);
+    }
+    inode_set_free(&node->visited);
+    free(node->name);
+    free(node);
+}
+
+
+/* открываем каталог node от ближайшего предка, держащего дескриптор, корень -
+от каталога списка. Предки не закрывают дескриптор, пока node не закончен */
+int du_open(const struct du_node *node)
+{
+    int parent_fd = (node->parent == NULL) ? node->base->fd : node->parent->fd;
+    int own = (parent_fd == -1);
+    if (own)  parent_fd = du_open(node->parent);
+    if (parent_fd == -1)  return -1;
+
+    int fd = openat(parent_fd, node->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (own)  close(parent_fd);
+    return fd;
+}
+
+
+/* кладём задачу в стек. Вызывается под du.lock */
+void du_push(struct du_node *node)
+{
+    node->next = du.tasks;
+    du.tasks = node;
+    pthread_cond_signal(&du.wake);
+}
+
+
+/* чтение каталога node закончено или каталог подсчитан другими задачами:
+законченные узлы отдают сумму родителю. Вызывается под du.lock;
+1 - закончен корень */
+int du_finish(struct du_node *node)
+{
+    node->pending--;
+    while (node->pending == 0)
+    {
+        struct du_node *parent = node->parent;
+        du_node_close(node);
+        if (!node->incomplete)  du_cache_store(node);
+        if (parent == NULL)
+        {
+            inode_set_free(&node->visited);
+            node->done = 1;
+            du.roots_done++;
+            du.changed = 1;
+            if (node->detached)  du_node_free(node);
+            return 1;
+        }
+
+        parent->bytes += node->bytes;
+        parent->blocks += node->blocks;
+        parent->incomplete |= node->incomplete;
+        du_node_free(node);
+        node = parent;
+        node->pending--;
+    }
+    return 0;
+}
+
+
+/* одна задача: складываем размеры файлов каталога, подкаталоги из кэша
+берём сразу, остальные ставим в стек. Вызывается без блокировки */
+void du_read(struct du_node *node)
+{
+    struct du_node *root = node->root;
+    struct du_node *children = NULL;
+    unsigned long long bytes = 0;
+    unsigned long long blocks = 0;
+    int incomplete = 1;
+    int cached = 0;
+
+    /* корень знаем только по имени - его lstat берём здесь; ссылка на каталог
+    считается сама, как и у du */
+    struct stat st;
+    if (node == root)
+    {
+        cached = 1;
+        if (fstatat(root->base->fd, node->name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+        {
+            du_node_stat(node, &st);
+            cached = !S_ISDIR(st.st_mode);
+        }
+        pthread_mutex_lock(&du.lock);
+        inode_set_insert(&root->visited, node->dev, node->ino);
+        struct du_cache_entry *entry = (cached || root->recount) ? NULL : du_cache_lookup(node);
+        if (entry != NULL)
+        {
+            node->bytes = entry->bytes;
+            node->blocks = entry->blocks;
+            cached = 1;
+        }
+        pthread_mutex_unlock(&du.lock);
+    }
+
+    if (cached)
+    {
+        incomplete = 0;
+    }
+    else if (!__atomic_load_n(&root->cancelled, __ATOMIC_ACQUIRE))
+    {
+        unsigned long long traced = trace_begin();
+        unsigned int count = 0;
+        int dir_fd = du_open(node);
+        DIR *dir = (dir_fd == -1) ? NULL : fdopendir(dir_fd);
+        if (dir == NULL && dir_fd != -1)  close(dir_fd);
+
+        /* нечитаемый каталог, как и у du, считается тем, что удалось сложить */
+        incomplete = 0;
+        struct dirent *entry;
+        while (dir != NULL && (entry = readdir(dir)) != NULL)
+        {
+            if (__atomic_load_n(&root->cancelled, __ATOMIC_RELAXED))
+            {
+                incomplete = 1;
+                break;
+            }
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+                continue;
+            if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1)  continue;
+            count++;
+
+            if (!S_ISDIR(st.st_mode))
+            {
+                bytes += st.st_size;
+                blocks += st.st_blocks;
+                continue;
+            }
+            if ((scan_flags & SCAN_ONE_FS) && st.st_dev != node->dev)  continue;
+
+            struct du_node *child = du_node_new(node, entry->d_name, &st);
+            if (child == NULL)
+            {
+                incomplete = 1;
+                continue;
+            }
+            child->next = children;
+            children = child;
+        }
+        /* дескриптор остаётся детям, если лимит позволяет; иначе они откроются от предков */
+        if (children != NULL && __atomic_add_fetch(&du.open_fds, 1, __ATOMIC_RELAXED) <= DU_MAX_FDS)
+        {
+            node->fd = dup(dirfd(dir));
+            if (node->fd == -1)  __atomic_sub_fetch(&du.open_fds, 1, __ATOMIC_RELAXED);
+        }
+        else if (children != NULL)
+        {
+            __atomic_sub_fetch(&du.open_fds, 1, __ATOMIC_RELAXED);
+        }
+        if (dir != NULL)  closedir(dir);
+        trace_end("du", traced, "%u", count);
+    }
+
+    pthread_mutex_lock(&du.lock);
+    if (node == root)
+    {
+        /* собственный размер корня в частичную сумму ещё не попал */
+        root->started = 1;
+        root->partial_bytes += node->bytes;
+        root->partial_blocks += node->blocks;
+    }
+    node->bytes += bytes;
+    node->blocks += blocks;
+    node->incomplete |= incomplete;
+    root->partial_bytes += bytes;
+    root->partial_blocks += blocks;
+
+    while (children != NULL)
+    {
+        struct du_node *child = children;
+        children = child->next;
+
+        /* каталог уже в этом обходе - цикл или второе монтирование того же */
+        if (inode_set_insert(&root->visited, child->dev, child->ino) == 0)
+        {
+            du_node_free(child);
+            continue;
+        }
+
+        struct du_cache_entry *entry = du_cache_lookup(child);
+        if (entry != NULL)
+        {
+            node->bytes += entry->bytes;
+            node->blocks += entry->blocks;
+            root->partial_bytes += entry->bytes;
+            root->partial_blocks += entry->blocks;
+            du_node_free(child);
+            continue;
+        }
+        root->partial_bytes += child->bytes;
+        root->partial_blocks += child->blocks;
+        node->pending++;
+        du_push(child);
+    }
+
+    du.changed = 1;
+    int wake = du_finish(node);
+    if (!wake && elapsed_ns(&du.last_wake) >= DU_PUBLISH_NS)  wake = 1;
+    if (wake)  clock_gettime(CLOCK_MONOTONIC, &du.last_wake);
+    pthread_mutex_unlock(&du.lock);
+
+    if (wake)  wake_main_loop();
+}
+
+
+void *du_main(void *arg)
+{
+    (void)arg;
+    trace_thread_name("du");
+
+    pthread_mutex_lock(&du.lock);
+    while (1)
+    {
+        struct du_node *node = du.tasks;
+        if (node == NULL)
+        {
+            if (du.stop)  break;
+            pthread_cond_wait(&du.wake, &du.lock);
+            continue;
+        }
+
+        du.tasks = node->next;
+        pthread_mutex_unlock(&du.lock);
+        du_read(node);
+        pthread_mutex_lock(&du.lock);
+    }
+    pthread_mutex_unlock(&du.lock);
+    trace_thread_end();
+    return NULL;
+}
+
+
+/* подсчёт для прежнего списка больше не нужен: незаконченные корни отменяем,
+их задачи потоки снимают со стека без чтения */
+void du_cancel()
+{
+    pthread_mutex_lock(&du.lock);
+    for (unsigned int i = 0; i < du.root_count; i++)
+    {
+        struct du_node *root = du.roots[i];
+        if (root->done)
+        {
+            du_node_free(root);
+            continue;
+        }
+        root->detached = 1;
+        __atomic_store_n(&root->cancelled, 1, __ATOMIC_RELEASE);
+    }
+    if (du.base != NULL && --du.base->refs == 0)
+    {
+        close(du.base->fd);
+        free(du.base);
+    }
+    du.base = NULL;
+    du.root_count = 0;
+    du.roots_done = 0;
+    du.changed = 0;
+    if (du.slots != NULL)  memset(du.slots, 0, (du.slot_mask + 1) * sizeof(struct du_node *));
+    pthread_mutex_unlock(&du.lock);
+}
+
+
+/* слот имени в хэше корней: либо с корнем этого имени, либо пустой.
+Вызывается под du.lock */
+struct du_node **du_slot(const char *name)
+{
+    unsigned int i = name_hash(name) & du.slot_mask;
+    while (du.slots[i] != NULL && strcmp(du.slots[i]->name, name) != 0)
+    {
+        i = (i + 1) & du.slot_mask;
+    }
+    return &du.slots[i];
+}
+
+
+/* добавляем корень в хэш; прежний корень с тем же именем (каталог удалён
+и создан заново) больше ни с какой записью не связывается.
+Вызывается под du.lock; -1 - нет памяти */
+int du_slot_insert(struct du_node *root)
+{
+    if (2 * (du.root_count + 1) > du.slot_mask + 1)
+    {
+        unsigned int capacity = 256;
+        while (capacity < 2 * (du.root_count + 1))  capacity *= 2;
+        struct du_node **slots = calloc(capacity, sizeof(struct du_node *));
+        if (slots == NULL)  return -1;
+        free(du.slots);
+        du.slots = slots;
+        du.slot_mask = capacity - 1;
+        for (unsigned int i = 0; i < du.root_count; i++)
+        {
+            if (du.roots[i]->entry != (unsigned int)-1)  *du_slot(du.roots[i]->name) = du.roots[i];
+        }
+    }
+
+    struct du_node **slot = du_slot(root->name);
+    if (*slot != NULL)  (*slot)->entry = (unsigned int)-1;
+    *slot = root;
+    return 0;
+}
+
+
+/* корни для подкаталогов загруженного списка; первая строка считается первой.
+added - только для вставленных watch_refresh, у остальных корни уже есть.
+Вызывается под listing_lock */
+int du_start(int added)
+{
+    if (file_counter == 0 || loader.dir_fd == -1)  return 0;
+
+    struct du_node **tmp = realloc(du.roots, (du.root_count + file_counter) * sizeof(struct du_node *));
+    if (tmp == NULL)  return -8;
+    du.roots = tmp;
+
+    while (du.threads_running < DU_THREADS)
+    {
+        if (pthread_create(&du.threads[du.threads_running], NULL, du_main, NULL) != 0)  break;
+        du.threads_running++;
+    }
+    if (du.threads_running == 0)  return -8;
+
+    pthread_mutex_lock(&du.lock);
+    if (du.base == NULL)
+    {
+        du.base = malloc(sizeof(struct du_base));
+        if (du.base != NULL)  du.base->fd = fcntl(loader.dir_fd, F_DUPFD_CLOEXEC, 0);
+        if (du.base == NULL || du.base->fd == -1)
+        {
+            free(du.base);
+            du.base = NULL;
+            pthread_mutex_unlock(&du.lock);
+            return -8;
+        }
+        du.base->refs = 1;
+    }
+
+    for (int i = file_counter - 1; i >= 0; i--)
+    {
+        struct file_info *file = &files[order[i]];
+        if (!S_ISDIR(file->mode) || file->pending || file->total == DU_COMPLETE)  continue;
+        if (added && file->total != DU_UNKNOWN)  continue;
+
+        struct du_node *root = du_node_new(NULL, file->real_name, NULL);
+        if (root == NULL)  break;
+        root->base = du.base;
+        du.base->refs++;
+        root->recount = added;
+        if (du_slot_insert(root) != 0)
+        {
+            du_node_free(root);
+            break;
+        }
+        root->entry = order[i];
+        file->total = DU_QUEUED;
+        du.roots[du.root_count++] = root;
+        du_push(root);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &du.last_wake);
+    pthread_mutex_unlock(&du.lock);
+    return 0;
+}
+
+
+/* запись корня в files или -1, если индекс устарел (записи сдвинулись после
+удалений из списка) или записи больше нет. Вызывается под listing_lock */
+int du_root_entry(const struct du_node *root)
+{
+    if (root->entry < (unsigned int)file_counter && strcmp(files[root->entry].real_name, root->name) == 0)
+        return root->entry;
+    return -1;
+}
+
+
+/* индексы всех корней заново: один проход по списку с поиском в хэше.
+Вызывается под listing_lock и du.lock */
+void du_reindex()
+{
+    for (int i = 0; i < file_counter; i++)
+    {
+        if (!S_ISDIR(files[i].mode))  continue;
+        struct du_node *root = *du_slot(files[i].real_name);
+        if (root != NULL)  root->entry = i;
+    }
+}
+
+
+/* из главного цикла: запускаем подсчёт, когда список каталога загружен,
+и переносим готовые и частичные суммы в строки. 1 - строки изменились */
+int du_refresh()
+{
+    pthread_mutex_lock(&listing_lock);
+    if (snapshot.data != NULL)
+    {
+        pthread_mutex_unlock(&listing_lock);
+        return 0;
+    }
+
+    if (du.listing_id != listing_id)
+    {
+        du_cancel();
+        du.listing_id = 0;
+        if (!loader.loading)
+        {
+            if (du_start(0) != 0)
+            {
+                wprintf(L"\e[%d;1HНе удалось запустить подсчёт размеров.", rows);
+            }
+            du.listing_id = listing_id;
+        }
+        du.added = 0;
+    }
+    else if (du.added)
+    {
+        /* новые подкаталоги из inotify */
+        du.added = 0;
+        if (du_start(1) != 0)
+        {
+            wprintf(L"\e[%d;1HНе удалось запустить подсчёт размеров.", rows);
+        }
+    }
+
+    int changed = 0;
+    pthread_mutex_lock(&du.lock);
+    if (du.changed)
+    {
+        du.changed = 0;
+        changed = 1;
+        int reindexed = 0;
+        for (unsigned int i = 0; i < du.root_count; i++)
+        {
+            struct du_node *root = du.roots[i];
+            if (!root->started || root->entry == (unsigned int)-1)  continue;
+            int entry = du_root_entry(root);
+            if (entry == -1 && !reindexed)
+            {
+                du_reindex();
+                reindexed = 1;
+                entry = du_root_entry(root);
+            }
+            if (entry == -1 || !S_ISDIR(files[entry].mode))  continue;
+
+            struct file_info *file = &files[entry];
+            file->size = root->done ? root->bytes : root->partial_bytes;
+            file->blocks = root->done ? root->blocks : root->partial_blocks;
+            file->total = (root->done && !root->incomplete) ? DU_COMPLETE : DU_PARTIAL;
+        }
+    }
+    pthread_mutex_unlock(&du.lock);
+
+    if (changed)
+    {
+        invalidate_rows();
+        if (SORT_COLUMN(sort_mode) == TABLE_COLUMNS - 1)
+        {
+            order_stale = 1;
+            sort_request();
+        }
+    }
+    pthread_mutex_unlock(&listing_lock);
+    return changed;
+}
+
+
+/* сколько корней из скольких подсчитано; вызывается под listing_lock */
+void du_progress(unsigned int *done, unsigned int *total)
+{
+    pthread_mutex_lock(&du.lock);
+    *done = du.roots_done;
+    *total = du.root_count;
+    pthread_mutex_unlock(&du.lock);
+}
+
+
+/* останавливаем потоки подсчёта перед выходом */
+void du_stop()
+{
+    du_cancel();
+    pthread_mutex_lock(&du.lock);
+    du.stop = 1;
+    pthread_cond_broadcast(&du.wake);
+    pthread_mutex_unlock(&du.lock);
+
+    for (unsigned int i = 0; i < du.threads_running; i++)
+    {
+        pthread_join(du.threads[i], NULL);
+    }
+    du.threads_running = 0;
+    free(du.roots);
+    du.roots = NULL;
+    free(du.slots);
+    du.slots = NULL;
+    free(du.cache.entries);
+    du.cache.entries = NULL;
+    du.cache.count = du.cache.capacity = 0;
+}
+
+
+/* останавливаем загрузку перед выходом, после этого список можно освобождать */
+void shutdown_loader()
+{
+    pthread_mutex_lock(&listing_lock);
+    stop_loading();
+    if (loader.dir_fd != -1)
+    {
+        close(loader.dir_fd);
+        loader.dir_fd = -1;
+    }
+    listing_cache_free();
+    stop_sorter();
+    pthread_mutex_unlock(&listing_lock);
+    du_stop();
+}
+
+
+/* сбрасываем положение просмотра и порядок перед новым списком.
+Вызывается под listing_lock */
+void reset_listing()
+{
+    struct view_state view = { 0 };
+    restore_view(&view);
+    cursor_moved = 0;
+    invalidate_rows();
+    listing_id++;
+    sort_cache_clear();
+    order_stale = 0;
+    order_sort = sort_mode;  /* пустой список уже в нужном порядке */
+    order_generation++;
+}
+
+
+/* переходим в каталог path: берём его список из кэша или начинаем
+постепенную загрузку вместо get_files. Положение просмотра сбрасывается
+или восстанавливается из кэша. При просмотре снимка список берётся из него.
+Вызывается под listing_lock; 0 - список есть или загрузка началась */
+int start_loading(char *path)
+{
+    int complete = !loader.loading && file_counter > 0;
+    stop_loading();
+
+    /* в терминале статистика - по текущему каталогу */
+    if (stats_enabled)  stats_reset();
+
+    if (snapshot.data != NULL)
+    {
+        reset_listing();
+        return snapshot_load();
+    }
+
+    /* уходим из каталога - его список может ещё пригодиться */
+    listing_cache_store(complete);
+    if (loader.dir_fd != -1)
+    {
+        close(loader.dir_fd);
+        loader.dir_fd = -1;
+    }
+
+    /* следим за каталогом до его чтения или проверки списка в кэше */
+    watch_directory(path);
+    reset_listing();
+
+    int dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    stats_add(STAT_OPEN, 1);
+    if (dir_fd == -1)
+    {
+        /* старый список не должен остаться под новым путём */
+        arena_release(&listing_arena, 0);
+        files = listing_arena.data;
+        file_counter = 0;
+        filter_apply();
+        wprintf(L"\e[%d;1HНе удалось открыть директорию.", rows);
+        fflush(stdout);
+        return -6;
+    }
+
+    if (listing_cache_restore(dir_fd))
+    {
+        /* список мог быть отсортирован по-другому */
+        filter_apply();
+        sort_request();
+        stats_add(STAT_ENTRIES, file_counter);
+        loader.dir_fd = dir_fd;
+        loader.loading = 0;
+        return 0;
+    }
+
+    arena_release(&listing_arena, 0);
+    files = listing_arena.data;
+    file_counter = 0;
+    filter_apply();
+
+    loader.dir_fd = dir_fd;
+    loader.cancel = 0;
+    loader.listed = 0;
+    loader.stated = 0;
+    loader.loading = 1;
+    if (pthread_create(&loader.thread, NULL, loader_main, NULL) != 0)
+    {
+        /* без потока загружаем по-старому, целиком */
+        loader.loading = 0;
+        close(loader.dir_fd);
+        loader.dir_fd = -1;
+        int count = get_files(path, &listing_arena, &files, &order);
+        filter_apply();
+        return count < 0 ? count : 0;
+    }
+    loader.running = 1;
+    return 0;
+}
+
+
+/* применяем накопленные изменения к списку; вызывается без listing_lock.
+1 - список изменился и его нужно перерисовать */
+
+int watch_refresh(char *path)
+{
+    pthread_mutex_lock(&listing_lock);
+    int timeout = watch_timeout();
+    pthread_mutex_unlock(&listing_lock);
+    if (timeout != 0)  return 0;
+    clock_gettime(CLOCK_MONOTONIC, &watch.last_refresh);
+
+    if (loader.dir_fd == -1)
+    {
+        /* каталог не открыт (загрузка не удалась) - обновлять нечего */
+        watch_clear();
+        return 0;
+    }
+
+    if (watch.overflow)
+    {
+        /* часть событий потеряна - перечитываем каталог, курсор остаётся на своей строке */
+        pthread_mutex_lock(&listing_lock);
+        struct view_state view;
+        save_view(&view);
+        start_loading(path);
+        restore_view(&view);
+        cursor_moved = 1;
+        pthread_mutex_unlock(&listing_lock);
+        return 1;
+    }
+
+    /* stat без блокировки: каталог читаем через fd загрузчика */
+    for (unsigned int i = 0; i < watch.count; i++)
+    {
+        struct file_info *file = &watch.dirty[i];
+        file->pending = 0;
+        if (stat_entry(loader.dir_fd, file) != 0)
+        {
+            file->mode = 0;  /* объекта больше нет */
+        }
+    }
+
+    pthread_mutex_lock(&listing_lock);
+    int entry = cursor_entry();
+    du_forget_ancestors(loader.dir_fd);
+
+    /* один проход по списку: обновляем на месте, удаляемые помечаем mode = 0.
+    У обновлённых на месте имён обнуляем mode, с ненулевым останутся только новые объекты */
+    int removed = 0;
+    int updated = 0;
+    for (int i = 0; i < file_counter; i++)
+    {
+        struct file_info *file = &files[i];
+        unsigned int *slot = watch_slot(file->real_name);
+        if (*slot == 0)  continue;
+
+        struct file_info *update = &watch.dirty[*slot - 1];
+        if (update->mode != 0 && S_ISDIR(update->mode) == S_ISDIR(file->mode))
+        {
+            /* событие о подкаталоге - его сумму считаем заново (update->total уже
+            DU_UNKNOWN), корень подсчёта для него заведёт du_start(1) */
+            if (S_ISDIR(file->mode))  du.added = 1;
+            *file = *update;
+            update->mode = 0;  /* уже в списке - вставлять не нужно */
+            updated = 1;
+        }
+        else
+        {
+            /* исчез или сменил тип, тогда меняется и место в сортировке */
+            file->mode = 0;
+            removed = 1;
+        }
+    }
+
+    if (removed)
+    {
+        /* сжимаем массив, перестановку переводим на новые индексы */
+        unsigned int *remap = malloc(file_counter * sizeof(unsigned int));
+        if (remap == NULL)
+        {
+            pthread_mutex_unlock(&listing_lock);
+            watch.overflow = 1;
+            return 0;
+        }
+
+        unsigned int kept = 0;
+        for (int i = 0; i < file_counter; i++)
+        {
+            if (files[i].mode == 0)
+            {
+                remap[i] = (unsigned int)-1;
+                continue;
+            }
+            remap[i] = kept;
+            if (kept != (unsigned int)i)  files[kept] = files[i];
+            kept++;
+        }
+
+        unsigned int position = 0;
+        int cursor_entry_pos = -1;
+        int passed = 0;
+        for (int i = 0; i < file_counter; i++)
+        {
+            if ((int)order[i] == entry)  passed = 1;
+            if (remap[order[i]] == (unsigned int)-1)  continue;
+            /* если запись под курсором удалена, курсор встаёт на следующую */
+            if (cursor_entry_pos == -1 && passed)  cursor_entry_pos = position;
+            order[position++] = remap[order[i]];
+        }
+
+        entry = (entry >= 0 && remap[entry] != (unsigned int)-1) ? (int)remap[entry] : -1;
+        if (entry == -1 && cursor_entry_pos != -1)  entry = order[cursor_entry_pos];
+        free(remap);
+        arena_release(&listing_arena, kept);
+        file_counter = kept;
+    }
+
+    /* новые объекты добавляем в конец и вливаем в порядок сортировки */
+    unsigned int old_count = listing_arena.used;
+    for (unsigned int i = 0; i < watch.count; i++)
+    {
+        if (watch.dirty[i].mode == 0)  continue;
+        struct file_info *file = arena_reserve(&listing_arena);
+        if (file == NULL)  break;
+        *file = watch.dirty[i];
+        arena_commit(&listing_arena);
+    }
+
+    files = listing_arena.data;
+    if (sort_merge(files, old_count, listing_arena.used - old_count, &order, order_sort) != 0)
+    {
+        arena_release(&listing_arena, old_count);
+    }
+    file_counter = listing_arena.used;
+    if (file_counter > (int)old_count)  du.added = 1;  /* новым подкаталогам нужны суммы */
+
+    relocate_cursor(entry);
+    invalidate_rows();
+
+    /* у обновлённых на месте записей могло измениться значение столбца сортировки */
+    if (updated && SORT_COLUMN(order_sort) != SORT_NAME)
+    {
+        order_stale = 1;
+        sort_request();
+    }
+    pthread_mutex_unlock(&listing_lock);
+
+    watch_clear();
+    return 1;
+}
+
+
+void watch_free()
+{
+    if (watch.fd != -1)  close(watch.fd);
+    watch.fd = -1;
+    free(watch.dirty);
+    free(watch.slots);
+}
+
+
+/* расчёт размера колонок */
+void count_columns_width(unsigned short x, unsigned int columns[])
+{
+	/* имени - 3/10 ширины, остальное поровну между 7 столбцами за вычетом разделителей */
+    columns[0] = x * 3/10;
+    unsigned int rest = x - columns[0] > TABLE_COLUMNS - 1 ? x - columns[0] - (TABLE_COLUMNS - 1) : 0;
+    for (unsigned int i = 1; i < TABLE_COLUMNS; i++)
+    {
+        columns[i] = rest / (TABLE_COLUMNS - 1);
+    }
+}
+
+
+/* широкая строка, дополненная пробелами до width символов, как wprintf("%-*ls") */
+void out_wide_pad(struct out_buf *out, const wchar_t *str, unsigned int width)
+{
+    out_wide(out, str);
+
+    unsigned int length = wcslen(str);
+    if (length < width && out_reserve(out, width - length) == 0)
+    {
+        memset(out->data + out->used, ' ', width - length);
+        out->used += width - length;
+    }
+}
+
+
+void print_path(struct out_buf *out, char *path, struct winsize ws)
+{
+    wchar_t saved_path[PATH_MAX];
+    mbstowcs(saved_path, path, PATH_MAX);
+    saved_path[PATH_MAX - 1] = 0;
+
+    int path_length = wcslen(saved_path);
+
+    /* максимальное количество символов, на которое мы можем промотать */
+    int max_scroll = path_length - ws.ws_col;
+    if (max_scroll < 0) max_scroll = 0;
+
+    if (path_scroll > max_scroll) path_scroll = max_scroll;
+    if (path_scroll < 0)          path_scroll = 0;
+
+    wchar_t displayed_path[PATH_MAX];
+
+    /* весь путь помещается */
+    if (path_length <= ws.ws_col)
+    {
+        wcscpy(displayed_path, saved_path);
+    }
+    /* в начале - только '>' справа */
+    else if (path_scroll == 0)
+    {
+        wcscpy(displayed_path, saved_path);
+        displayed_path[ws.ws_col - 1] = L'>';
+        displayed_path[ws.ws_col] = 0;
+    }
+    /* в конце - только '<' слева */
+    else if (path_scroll == max_scroll)
+    {
+        displayed_path[0] = L'<';
+        wcscpy(displayed_path + 1, saved_path + path_scroll + 1);
+        displayed_path[ws.ws_col] = 0;
+    }
+    /* между - и '<', и '>' */
+    else
+    {
+        displayed_path[0] = L'<';
+        wcscpy(displayed_path + 1, saved_path + path_scroll + 1);
+        displayed_path[ws.ws_col - 1] = L'>';
+        displayed_path[ws.ws_col] = 0;
+    }
+
+    out_puts(out, "\e[1;1H\e[1;38;5;200m");
+    out_wide_pad(out, displayed_path, ws.ws_col);
+    out_puts(out, "\e[0m");
+}
+
+
+void print_string(struct out_buf *out, char *str, unsigned int column_width, unsigned int column_index) {
+    if (column_width <= 0) return;
+
+    wchar_t displayed_string[NAME_MAX];
+    mbstowcs(displayed_string, str, NAME_MAX);
+    displayed_string[NAME_MAX - 1] = 0;
+
+    int string_length = wcslen(displayed_string);
+
+    /* если строка полностью помещается */
+    if (string_length <= column_width)
+    {
+        out_wide_pad(out, displayed_string, column_width);
+        return;
+    }
+
+    int s = column_scrolls[column_index];
+    if (s < 0) s = 0;
+    if (s > string_length - column_width) s = string_length - column_width;
+    column_scrolls[column_index] = s;
+
+    wchar_t buf[NAME_MAX];
+
+    /* заполним буфер пробелами */
+    for (int i = 0; i < column_width; i++) buf[i] = L' ';
+    buf[column_width] = 0;
+
+    /* копируем видимую часть строки */
+    wcsncpy(buf, displayed_string + s, column_width);
+
+    if (s > 0) buf[0] = L'<';
+    if (s + column_width < string_length) buf[column_width - 1] = L'>';
+
+    out_wide_pad(out, buf, column_width);
+}
+
+
+void display_data(struct out_buf *out, struct file_row *row, unsigned int columns[])
+{
+    char *file_ptr;
+    for (unsigned int i = 0; i < TABLE_COLUMNS; i++)
+    {
+        switch (i)
+        {
+            case 0: file_ptr = row->name;         break;
+            case 1: file_ptr = row->type;         break;
+            case 2: file_ptr = row->uid;          break;
+            case 3: file_ptr = row->gid;          break;
+            case 4: file_ptr = row->permissions;  break;
+            case 5: file_ptr = row->mtime;        break;
+            case 6: file_ptr = row->atime;        break;
+            case 7: file_ptr = row->size;         break;
+        }
+
+        print_string(out, file_ptr, columns[i], i);
+
+        if (i < TABLE_COLUMNS - 1) out_puts(out, "|");
+    }
+}
+
+
+void print_header(struct out_buf *out, unsigned int columns[])
+{
+    out_puts(out, "\e[2;1H");
+    for (int i = 0; i < TABLE_COLUMNS; i++)
+    {
+        if (i == active_column)
+        {
+            out_puts(out, "\e[1;3;48;5;198m");
+        }
+        else
+        {
+            out_puts(out, "\e[3;38;5;198m");
+        }
+
+        char *column_name;
+        switch (i)
+        {
+            case 0: column_name = "name";         break;
+            case 1: column_name = "type";         break;
+            case 2: column_name = "owner";        break;
+            case 3: column_name = "group";        break;
+            case 4: column_name = "permissions";  break;
+            case 5: column_name = "mtime";        break;
+            case 6: column_name = "atime";        break;
+            case 7: column_name = size_apparent ? "bytes" : "size";  break;
+        }
+
+        /* столбец сортировки отмечаем направлением */
+        char title[32];
+        if (i == SORT_COLUMN(sort_mode))
+        {
+            snprintf(title, sizeof(title), "%s %s", column_name, (sort_mode & SORT_DESCENDING) ? "v" : "^");
+            column_name = title;
+        }
+
+        print_string(out, column_name, columns[i], i);
+
+        out_puts(out, "\e[0m");
+        if (i < TABLE_COLUMNS - 1) out_puts(out, "|");
+    }
+}
+
+
+/* строка таблицы с индексом i на своём месте экрана (таблица начинается с 3-й строки) */
+void print_table_row(struct out_buf *out, int i, unsigned int columns[])
+{
+    char position[32];
+    int size = snprintf(position, sizeof(position), "\e[%d;1H", 3 + i - scroll_pos);
+    out_write(out, position, size);
+
+    if (i == cursor_pos)
+    {
+        out_puts(out, "\e[1;48;5;212m");
+    }
+    display_data(out, get_row(visible_entry(i)), columns);
+    if (i == cursor_pos)
+    {
+        out_puts(out, "\e[0m");
+    }
+}
+
+
+/* что было на экране после прошлой отрисовки: по разнице с текущим
+состоянием решаем, какие строки перерисовать */
+struct frame_state
+{
+    int valid;
+    unsigned short ws_row;
+    unsigned short ws_col;
+    unsigned int listing_id;
+    unsigned int generation;  /* listing_generation */
+    unsigned int filter_generation;
+    unsigned int order_generation;
+    int sort_mode;
+    int file_counter;         /* видимых строк */
+    int cursor_pos;
+    int scroll_pos;
+    int path_scroll;
+    int active_column;
+    int column_scrolls[TABLE_COLUMNS];
+};
+
+struct frame_state last_frame;
+struct out_buf frame = { .fd = 1 };  /* кадр уходит в терминал одним write() */
+int terminal_fd = 1;                 /* откуда берём размер окна (stdout); у бенчмарка - свой pty */
+
+
+/* пиковая резидентная память процесса, КБ */
+long peak_rss_kb()
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == -1)  return 0;
+    return usage.ru_maxrss;
+}
+
+
+double phase_ms(enum stat_phase phase)
+{
+    return __atomic_load_n(&stats.phase_ns[phase], __ATOMIC_RELAXED) / 1e6;
+}
+
+
+unsigned long long stats_counter(enum stat_counter counter)
+{
+    return __atomic_load_n(&stats.counters[counter], __ATOMIC_RELAXED);
+}
+
+
+/* короткая статистика текущего каталога в нижнюю строку, не шире width */
+void print_stats(struct out_buf *out, unsigned short width)
+{
+    wchar_t line[256];
+    swprintf(line, sizeof(line) / sizeof(wchar_t),
+             L"\e[3m%llu объектов | stat %llu, %.1f мс | NSS %llu, %.1f мс | сортировка %.1f мс | вывод %llu КБ | память %ld КБ",
+             stats_counter(STAT_ENTRIES),
+             stats_counter(STAT_STAT) + stats_counter(STAT_STATX), phase_ms(PHASE_STAT),
+             stats_counter(STAT_NSS), phase_ms(PHASE_NSS),
+             phase_ms(PHASE_SORT), stats_counter(STAT_BYTES) >> 10, peak_rss_kb());
+
+    /* \e[3m не занимает места на экране */
+    if (wcslen(line) > width + 4u)  line[width + 4] = 0;
+    out_wide(out, line);
+    out_puts(out, "\e[0m");
+}
+
+
+/* строка фильтра с числом совпадений, не шире width */
+void print_filter(struct out_buf *out, unsigned short width)
+{
+    /* символ ещё не дочитан до конца - показываем образец без него */
+    char pattern[NAME_MAX + 1];
+    strcpy(pattern, filter.pattern);
+    for (size_t length = strlen(pattern); length > 0 && mbstowcs(NULL, pattern, 0) == (size_t)-1; )
+    {
+        pattern[--length] = 0;
+    }
+
+    wchar_t line[NAME_MAX + 128];
+    swprintf(line, sizeof(line) / sizeof(wchar_t), L"\e[3mФильтр: %s%ls%ls%ls | %d из %d",
+             pattern, filter.editing ? L"_" : L"",
+             (filter.mode & FILTER_IGNORE_CASE) ? L" | без регистра" : L"",
+             (filter.mode & FILTER_FUZZY) ? L" | нечёткий" : L"",
+             visible_count(), file_counter);
+
+    /* \e[3m не занимает места на экране */
+    if (wcslen(line) > width + 4u)  line[width + 4] = 0;
+    out_wide(out, line);
+    out_puts(out, "\e[0m");
+}
+
+
+/* следующая отрисовка перерисует весь экран */
+void invalidate_frame()
+{
+    last_frame.valid = 0;
+}
+
+
+int display_in_terminal(char *path)
+{
+    unsigned long long traced = trace_begin();
+
+    /* получаем размер окна */
+    struct winsize ws;
+    if (ioctl(terminal_fd, TIOCGWINSZ, &ws) == -1)
+    {
+        wprintf(L"\e[%d;1HНе удалось получить размер окна терминала.", rows);
+        fflush(stdout);
+        return -9;
+    }
+    rows = ws.ws_row;
+
+    /* считаем столбцы для таблицы */
+	unsigned int columns[TABLE_COLUMNS];
+    count_columns_width(ws.ws_col, columns);
+
+    /* считаем строки для таблицы, чтобы заголовки остались сверху */
+    int height = ws.ws_row - 3;
+    if (height < 1)
+    {
+        height = 1;
+    }
+
+    /* список мог измениться под курсором (загрузка, обновление, фильтр, уменьшение окна);
+    внизу таблицы не оставляем пустых строк, если записи есть выше */
+    int count = visible_count();
+    if (cursor_pos >= count)                cursor_pos = (count > 0) ? count - 1 : 0;
+    if (scroll_pos > count - height)        scroll_pos = (count > height) ? count - height : 0;
+    if (scroll_pos > cursor_pos)            scroll_pos = cursor_pos;
+    if (cursor_pos >= scroll_pos + height)  scroll_pos = cursor_pos - height + 1;
+
+    int data_end = height + scroll_pos;
+    if (data_end > count)
+    {
+        data_end = count;
+    }
+
+    /* сообщения об ошибках, выведенные через wprintf, должны уйти раньше кадра */
+    fflush(stdout);
+
+    /* полностью перерисовываем только при изменении размера окна или каталога */
+    int full = !last_frame.valid
+            || last_frame.ws_row != ws.ws_row
+            || last_frame.ws_col != ws.ws_col
+            || last_frame.listing_id != listing_id;
+
+    int columns_changed = full || last_frame.active_column != active_column
+            || last_frame.sort_mode != sort_mode
+            || memcmp(last_frame.column_scrolls, column_scrolls, sizeof(column_scrolls)) != 0;
+
+    /* записи добавились или обновились - перерисовываем видимые строки */
+    int rows_changed = columns_changed
+            || last_frame.generation != listing_generation
+            || last_frame.filter_generation != filter.generation
+            || last_frame.order_generation != order_generation
+            || last_frame.file_counter != count;
+
+    if (full)
+    {
+        /* очищаем экран и перемещаем курсор на начало экрана */
+        out_puts(&frame, "\e[2J\e[H");
+    }
+
+    /* нижняя строка - для хода загрузки и сообщений об ошибках, убираем старое */
+    char status[128];
+    int status_size = snprintf(status, sizeof(status), "\e[%d;1H\e[K", ws.ws_row);
+    out_write(&frame, status, status_size);
+    unsigned int du_done, du_total;
+    du_progress(&du_done, &du_total);
+    if (filter.editing || filter.length > 0)
+    {
+        print_filter(&frame, ws.ws_col);
+    }
+    else if (loader.loading)
+    {
+        if (loader.stated == 0)
+            status_size = snprintf(status, sizeof(status), "\e[3mЗагрузка: %u объектов...\e[0m", loader.listed);
+        else
+            status_size = snprintf(status, sizeof(status), "\e[3mЗагрузка атрибутов: %u из %u...\e[0m",
+                                   loader.stated, loader.listed);
+        out_write(&frame, status, status_size);
+    }
+    else if (sort_pending())
+    {
+        out_wide(&frame, L"\e[3mСортировка...\e[0m");
+    }
+    else if (du_done < du_total)
+    {
+        status_size = snprintf(status, sizeof(status), "\e[3mПодсчёт размеров: %u из %u каталогов...\e[0m",
+                               du_done, du_total);
+        out_write(&frame, status, status_size);
+    }
+    else if (stats_enabled)
+    {
+        print_stats(&frame, ws.ws_col);
+    }
+
+    if (full || last_frame.path_scroll != path_scroll)
+    {
+        print_path(&frame, path, ws);
+    }
+
+    if (rows_changed)
+    {
+        /* поменялась колонка, её прокрутка или сами записи - перерисовываем всю таблицу */
+        if (columns_changed)  print_header(&frame, columns);
+        for (int i = scroll_pos; i < data_end; i++)
+        {
+            print_table_row(&frame, i, columns);
+        }
+
+        /* строки, оставшиеся от более длинного списка */
+        for (int line = 3 + data_end - scroll_pos; !full && line < 3 + height; line++)
+        {
+            char position[32];
+            int size = snprintf(position, sizeof(position), "\e[%d;1H\e[K", line);
+            out_write(&frame, position, size);
+        }
+    }
+    else
+    {
+        int shift = scroll_pos - last_frame.scroll_pos;
+        int first = 0;  /* новые строки [first, last) после прокрутки */
+        int last = 0;
+
+        if (shift != 0 && abs(shift) < height)
+        {
+            /* сдвигаем таблицу средствами терминала в области прокрутки */
+            char scroll[64];
+            int size = snprintf(scroll, sizeof(scroll), "\e[3;%dr\e[%d%c\e[r",
+                                2 + height, abs(shift), shift > 0 ? 'S' : 'T');
+            out_write(&frame, scroll, size);
+
+            first = (shift > 0) ? data_end - shift : scroll_pos;
+            last = (shift > 0) ? data_end : scroll_pos - shift;
+        }
+        else if (shift != 0)
+        {
+            first = scroll_pos;
+            last = data_end;
+        }
+
+        for (int i = first; i < last; i++)
+        {
+            print_table_row(&frame, i, columns);
+        }
+
+        /* строки, с которых ушёл и на которую пришёл курсор */
+        int old_cursor = last_frame.cursor_pos;
+        if (old_cursor != cursor_pos && old_cursor >= scroll_pos && old_cursor < data_end
+            && (old_cursor < first || old_cursor >= last))
+        {
+            print_table_row(&frame, old_cursor, columns);
+        }
+        if ((old_cursor != cursor_pos || shift != 0) && cursor_pos >= scroll_pos && cursor_pos < data_end
+            && (cursor_pos < first || cursor_pos >= last))
+        {
+            print_table_row(&frame, cursor_pos, columns);
+        }
+    }
+
+    size_t frame_size = frame.used;
+    out_flush(&frame);
+    trace_end(full ? "frame full" : "frame", traced, "%zu bytes", frame_size);
+
+    last_frame.valid = 1;
+    last_frame.ws_row = ws.ws_row;
+    last_frame.ws_col = ws.ws_col;
+    last_frame.listing_id = listing_id;
+    last_frame.generation = listing_generation;
+    last_frame.filter_generation = filter.generation;
+    last_frame.order_generation = order_generation;
+    last_frame.sort_mode = sort_mode;
+    last_frame.file_counter = count;
+    last_frame.cursor_pos = cursor_pos;
+    last_frame.scroll_pos = scroll_pos;
+    last_frame.path_scroll = path_scroll;
+    last_frame.active_column = active_column;
+    memcpy(last_frame.column_scrolls, column_scrolls, sizeof(column_scrolls));
+
+    return 0;
+}
+
+
+/* SIGWINCH заблокирован и приходит через signalfd вместе с остальными событиями
+главного цикла, обработчика сигнала нет */
+int signal_fd = -1;
+
+#define FRAME_NS  16000000L  /* не больше одного кадра за 16 мс */
+
+
+/* ввод с терминала: всё, что пришло к пробуждению, читается в буфер сразу,
+а не по байту на read. Стрелки из буфера разбираются в коды KEY_* */
+#define INPUT_MAX 4096
+
+enum key
+{
+    KEY_UP = 256,
+    KEY_DOWN,
+    KEY_RIGHT,
+    KEY_LEFT,
+    KEY_ESC,   /* отдельный Esc */
+    KEY_NONE   /* неизвестная или оборванная последовательность */
+};
+
+struct input
+{
+    unsigned char data[INPUT_MAX];
+    unsigned int start;  /* первый ещё не разобранный байт */
+    unsigned int end;
+};
+
+struct input input;
+
+
+/* дочитываем всё, что уже есть в терминале; если нет ничего, ждём до timeout_ms.
+Возвращает число прочитанных байт, -1 - ввод закончился */
+int input_fill(int timeout_ms)
+{
+    if (input.start > 0)
+    {
+        memmove(input.data, input.data + input.start, input.end - input.start);
+        input.end -= input.start;
+        input.start = 0;
+    }
+
+    int total = 0;
+    while (input.end < INPUT_MAX)
+    {
+        struct pollfd next = {.fd = 0, .events = POLLIN};  /* stdin = 0 */
+        if (poll(&next, 1, total > 0 ? 0 : timeout_ms) <= 0)  break;
+
+        ssize_t read_bytes = read(0, input.data + input.end, INPUT_MAX - input.end);
+        if (read_bytes == 0)  return total > 0 ? total : -1;
+        if (read_bytes == -1)  break;
+        input.end += read_bytes;
+        total += read_bytes;
+    }
+    return total;
+}
+
+
+/* следующая клавиша из буфера: байт или KEY_*. CSI снимается до байта 0x40-0x7e,
+SS3 - с одним байтом; продолжение ждём до FILTER_ESC_MS, поэтому без listing_lock */
+int input_key()
+{
+    int key = input.data[input.start++];
+    if (key != 27)  return key;
+
+    if (input.start == input.end && input_fill(FILTER_ESC_MS) <= 0)  return KEY_ESC;
+    unsigned char kind = input.data[input.start];
+    if (kind != '[' && kind != 'O')  return KEY_ESC;
+    input.start++;
+
+    unsigned char final = 0;
+    while (final == 0)
+    {
+        /* оборванную последовательность отбрасываем */
+        if (input.start == input.end && input_fill(FILTER_ESC_MS) <= 0)  return KEY_NONE;
+
+        unsigned char c = input.data[input.start];
+        if (c < 0x20 || c > 0x7e)  return KEY_NONE;  /* управляющий байт - уже следующая клавиша */
+        input.start++;
+        if (kind == 'O' || c >= 0x40)  final = c;     /* у CSI 0x20-0x3f - параметры */
+    }
+
+    switch (final)
+    {
+        case 'A':  return KEY_UP;
+        case 'B':  return KEY_DOWN;
+        case 'C':  return KEY_RIGHT;
+        case 'D':  return KEY_LEFT;
+        default:   return KEY_NONE;
+    }
+}
+
+
+/* курсор на delta строк вниз или вверх; 1 - курсор сдвинулся */
+int move_cursor(int delta)
+{
+    int count = visible_count();
+    int target = cursor_pos + delta;
+    if (target > count - 1)  target = count - 1;
+    if (target < 0)          target = 0;
+    if (target == cursor_pos)  return 0;
+
+    cursor_pos = target;
+    cursor_moved = 1;
+    if (cursor_pos < scroll_pos)
+    {
+        scroll_pos = cursor_pos;
+    }
 
-    /* получаем размер окна */
     struct winsize ws;
-    if (ioctl(1, TIOCGWINSZ, &ws) == -1)  /* stdout = 1 */
+    if (ioctl(terminal_fd, TIOCGWINSZ, &ws) != -1)
+    {
+        rows = ws.ws_row;
+        int height = ws.ws_row - 3;
+        if (height < 1)
+        {
+            height = 1;
+        }
+        if (cursor_pos >= scroll_pos + height)
+        {
+            scroll_pos = cursor_pos - height + 1;
+        }
+    }
+    return 1;
+}
+
+
+/* узлы снимка ещё можно читать: файл не укоротили после открытия */
+int snapshot_check()
+{
+    if (snapshot_intact(&snapshot))  return 1;
+    wprintf(L"\e[%d;1HФайл снимка укорочен после открытия.", rows);
+    fflush(stdout);
+    return 0;
+}
+
+
+/* переход в каталог снимка index: путь для заголовка и список.
+Вызывается после snapshot_check */
+int snapshot_enter(unsigned int index)
+{
+    if (snapshot_path(&snapshot, index, path) != 0)
+    {
+        wprintf(L"\e[%d;1HСлишком длинный путь.", rows);
+        fflush(stdout);
+        return 0;
+    }
+
+    unsigned int from = snapshot.current;
+    snapshot.current = index;
+    filter_clear();
+    invalidate_frame();
+    if (start_loading(path) != 0)
+    {
+        wprintf(L"\e[%d;1HНе удалось получить файлы в директории.", rows);
+        fflush(stdout);
+        return 0;
+    }
+
+    /* поднялись к родителю - курсор на каталоге, из которого пришли */
+    if (snapshot.nodes[from].parent == index && from != index && from - snapshot.first < (unsigned int)file_counter)
+    {
+        cursor_to_entry(from - snapshot.first);
+    }
+    return 1;
+}
+
+
+/* действие одной клавиши: -1 - выход, 1 - нужна перерисовка */
+int key_action(int key)
+{
+    /* пока вводится фильтр, символы идут в него */
+    if (filter.editing && key < 256 && filter_input(key))  return 1;
+
+    switch (key)
+    {
+        default:  return 0;
+        case 'q': return -1; /* выход из программы */
+        case 'Q': return -1;
+        case 4:   return -1; /* 4 - ctrl + d */
+
+        /* промотка пути */
+        case '<':
+            path_scroll--;
+            if (path_scroll < 0)
+            {
+                path_scroll = 0;
+            }
+            return 1;
+
+        case '>':
+            path_scroll++;
+            return 1;
+
+        /* сортировка по активному столбцу, повторно - в обратном порядке */
+        case 's':
+            sort_mode = (SORT_COLUMN(sort_mode) == active_column) ? sort_mode ^ SORT_DESCENDING : active_column;
+            sort_request();
+            return 1;
+
+        /* столбец size: занятое на диске место или длина */
+        case 'b':
+            size_apparent = !size_apparent;
+            invalidate_rows();
+            invalidate_frame();
+            if (SORT_COLUMN(sort_mode) == TABLE_COLUMNS - 1)
+            {
+                order_stale = 1;
+                sort_request();
+            }
+            return 1;
+
+        /* фильтр по имени */
+        case '/':
+            filter.editing = 1;
+            return 1;
+
+        /* переключение активного столбца */
+        case '[':
+            if (active_column > 0)
+            {
+                active_column--;
+                return 1;
+            }
+            break;
+
+        case ']':
+            if (active_column < TABLE_COLUMNS - 1)
+            {
+                active_column++;
+                return 1;
+            }
+            break;
+
+        /* переход на родительский каталог */
+        case '^':
+            if (snapshot.data != NULL)
+            {
+                if (snapshot.current == 0 || !snapshot_check())  return 0;
+                return snapshot_enter(snapshot.nodes[snapshot.current].parent);
+            }
+            if (chdir("..") == 0)
+            {
+                filter_clear();
+                invalidate_frame();  /* сменился каталог - перерисовываем всё */
+                if (getcwd(path, PATH_MAX) == NULL)
+                {
+                    wprintf(L"\e[%d;1HНе удалось получить путь к рабочему каталогу.", rows);
+                    fflush(stdout);
+                    return 0;
+                }
+
+                if (start_loading(path) != 0)
+                {
+                    wprintf(L"\e[%d;1HНе удалось получить файлы в директории.", rows);
+                    fflush(stdout);
+                    return 0;
+                }
+
+                return 1;
+            }
+            break;
+
+        /* переход в выбранный каталог */
+        case '\n':
+            /* в ссылку на каталог тоже можно войти: цель проверяем при входе */
+            if (snapshot.data != NULL)
+            {
+                /* в снимке ссылки не обходятся: у них нет детей */
+                if (cursor_entry() >= 0 && S_ISDIR(files[cursor_entry()].mode))
+                {
+                    return snapshot_check() ? snapshot_enter(snapshot.first + cursor_entry()) : 0;
+                }
+                break;
+            }
+            if (cursor_entry() >= 0 && (S_ISDIR(files[cursor_entry()].mode) || S_ISLNK(files[cursor_entry()].mode)))
+            {
+                char full_path[PATH_MAX];
+                if (snprintf(full_path, PATH_MAX, "%s/%s", path, files[cursor_entry()].real_name) >= PATH_MAX)
+                {
+                    wprintf(L"\e[%d;1HСлишком длинный путь.", rows);
+                    fflush(stdout);
+                    return 0;
+                }
+
+                struct stat target;
+                if (S_ISLNK(files[cursor_entry()].mode) && (stat(full_path, &target) == -1 || !S_ISDIR(target.st_mode)))
+                {
+                    break;
+                }
+
+                if (chdir(full_path) == 0)
+                {
+                    filter_clear();
+                    invalidate_frame();  /* сменился каталог - перерисовываем всё */
+                    if (getcwd(path, PATH_MAX) == NULL)
+                    {
+                        wprintf(L"\e[%d;1HНе удалось получить путь к рабочему каталогу.", rows);
+                        fflush(stdout);
+                        return 0;
+                    }
+
+                    if (start_loading(path) != 0)
+                    {
+                        wprintf(L"\e[%d;1HНе удалось получить файлы в директории.", rows);
+                        fflush(stdout);
+                        return 0;
+                    }
+
+                    return 1;
+                }
+                else
+                {
+                    wprintf(L"\e[%d;1HНет доступа к директории.", rows);
+                    fflush(stdout);
+                    return 0;
+                }
+            }
+            break;
+
+        /* отдельный Esc снимает фильтр */
+        case KEY_ESC:
+            if (filter.editing || filter.length > 0)
+            {
+                filter_clear();
+                return 1;
+            }
+            break;
+
+        /* промотка активного столбца */
+        case KEY_RIGHT:
+            column_scrolls[active_column]++;
+            return 1;
+
+        case KEY_LEFT:
+            column_scrolls[active_column]--;
+            if (column_scrolls[active_column] < 0)
+                column_scrolls[active_column] = 0;
+            return 1;
+    }
+
+    return 0;
+}
+
+
+/* разбираем весь накопленный ввод без listing_lock, применяем под ним; подряд
+идущие стрелки складываются в один сдвиг. -1 - выход, 1 - нужна перерисовка */
+
+int keyboard_input()
+{
+    if (input_fill(0) == -1 && input.start == input.end)  return -1;
+
+    int keys[INPUT_MAX];
+    unsigned int count = 0;
+    while (input.start < input.end && count < INPUT_MAX)
+    {
+        keys[count++] = input_key();
+    }
+
+    pthread_mutex_lock(&listing_lock);
+    int result = 0;
+    int delta = 0;
+    for (unsigned int i = 0; i < count && result != -1; i++)
+    {
+        if (keys[i] == KEY_UP || keys[i] == KEY_DOWN)
+        {
+            delta += (keys[i] == KEY_DOWN) ? 1 : -1;
+            continue;
+        }
+
+        if (delta != 0 && move_cursor(delta))  result = 1;
+        delta = 0;
+
+        int action = key_action(keys[i]);
+        if (action == -1)  result = -1;
+        if (action == 1)   result = 1;
+    }
+
+    if (result != -1 && delta != 0 && move_cursor(delta))  result = 1;
+    pthread_mutex_unlock(&listing_lock);
+    return result;
+}
+
+
+void display_data_in_file(struct out_buf *out, struct file_row *row, unsigned int columns[])
+{
+    char *file_ptr;
+    for (unsigned int i = 0; i < 7; i++)
+    {
+        switch (i)
+        {
+            case 0: file_ptr = row->name;         break;
+            case 1: file_ptr = row->type;         break;
+            case 2: file_ptr = row->uid;          break;
+            case 3: file_ptr = row->gid;          break;
+            case 4: file_ptr = row->permissions;  break;
+            case 5: file_ptr = row->mtime;        break;
+            case 6: file_ptr = row->atime;        break;
+        }
+
+        out_pad(out, file_ptr, columns[i]);
+
+        if (i < 6) out_write(out, "|", 1);
+    }
+    out_write(out, "\n", 1);
+}
+
+
+/* целое в десятичной записи без printf */
+void out_decimal(struct out_buf *out, long long value)
+{
+    char digits[24];
+    int length = 0;
+    unsigned long long magnitude = (value < 0) ? -(unsigned long long)value : (unsigned long long)value;
+    do
+    {
+        digits[sizeof(digits) - 1 - length++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude != 0);
+    if (value < 0)  digits[sizeof(digits) - 1 - length++] = '-';
+    out_write(out, digits + sizeof(digits) - length, length);
+}
+
+
+/* длина корректной последовательности UTF-8 в начале str; 0 - байт не начинает символ */
+int utf8_sequence_length(const unsigned char *str, size_t size)
+{
+    unsigned char c = str[0];
+    int length;
+    unsigned char low = 0x80, high = 0xbf;  /* допустимый второй байт */
+
+    if (c < 0x80)                   return 1;
+    else if (c >= 0xc2 && c <= 0xdf)  length = 2;
+    else if (c >= 0xe0 && c <= 0xef)
+    {
+        length = 3;
+        if (c == 0xe0)  low = 0xa0;   /* без избыточной записи */
+        if (c == 0xed)  high = 0x9f;  /* без суррогатов */
+    }
+    else if (c >= 0xf0 && c <= 0xf4)
+    {
+        length = 4;
+        if (c == 0xf0)  low = 0x90;
+        if (c == 0xf4)  high = 0x8f;  /* не больше U+10FFFF */
+    }
+    else  return 0;
+
+    if (size < (size_t)length || str[1] < low || str[1] > high)  return 0;
+    for (int i = 2; i < length; i++)
+    {
+        if ((str[i] & 0xc0) != 0x80)  return 0;
+    }
+    return length;
+}
+
+
+/* байты имени внутри строки JSON. Имена в Linux - произвольные байты:
+байт, не образующий символ UTF-8, пишем как \udcXX (surrogateescape в Python),
+так исходное имя восстанавливается без потерь */
+void out_json_bytes(struct out_buf *out, const char *data, size_t size)
+{
+    const unsigned char *str = (const unsigned char *)data;
+    size_t plain = 0;  /* начало ещё не записанных байтов без экранирования */
+    for (size_t i = 0; i < size; )
+    {
+        unsigned char c = str[i];
+        int length = (c >= 0x20 && c < 0x80 && c != '"' && c != '\\') ? 1 : 0;
+        if (c >= 0x80)  length = utf8_sequence_length(str + i, size - i);
+        if (length > 0)
+        {
+            i += length;
+            continue;
+        }
+
+        out_write(out, data + plain, i - plain);
+        char escape[8];
+        if (c == '"' || c == '\\')  snprintf(escape, sizeof(escape), "\\%c", c);
+        else if (c < 0x20)          snprintf(escape, sizeof(escape), "\\u%04x", c);
+        else                        snprintf(escape, sizeof(escape), "\\udc%02x", c);
+        out_puts(out, escape);
+        plain = ++i;
+    }
+    out_write(out, data + plain, size - plain);
+}
+
+
+/* байты пути в строке текстового --delta: одна запись - одна строка, поэтому
+обратная косая черта и управляющие байты экранируются как в C (\\, \n, \t, \xNN) */
+void out_text_bytes(struct out_buf *out, const char *data, size_t size)
+{
+    const unsigned char *str = (const unsigned char *)data;
+    size_t plain = 0;
+    for (size_t i = 0; i < size; i++)
+    {
+        unsigned char c = str[i];
+        if (c >= 0x20 && c != 0x7f && c != '\\')  continue;
+
+        out_write(out, data + plain, i - plain);
+        char escape[8];
+        if (c == '\\')       snprintf(escape, sizeof(escape), "\\\\");
+        else if (c == '\n')  snprintf(escape, sizeof(escape), "\\n");
+        else if (c == '\t')  snprintf(escape, sizeof(escape), "\\t");
+        else                 snprintf(escape, sizeof(escape), "\\x%02x", c);
+        out_puts(out, escape);
+        plain = i + 1;
+    }
+    out_write(out, data + plain, size - plain);
+}
+
+
+/* часть поля CSV в кавычках по RFC 4180 (нужны, если в поле есть , " CR или LF):
+кавычки удваиваются. Поле можно писать по частям, сами кавычки ставит вызывающий */
+void out_csv_bytes(struct out_buf *out, const char *data, size_t size)
+{
+    size_t plain = 0;
+    for (size_t i = 0; i < size; i++)
+    {
+        if (data[i] != '"')  continue;
+        out_write(out, data + plain, i + 1 - plain);
+        plain = i;  /* кавычка попадёт в вывод второй раз */
+    }
+    out_write(out, data + plain, size - plain);
+}
+
+
+int csv_needs_quotes(const char *data, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        if (data[i] == ',' || data[i] == '"' || data[i] == '\r' || data[i] == '\n')  return 1;
+    }
+    return 0;
+}
+
+
+void out_le(struct out_buf *out, unsigned long long value, int size)
+{
+    unsigned char bytes[8];
+    for (int i = 0; i < size; i++)
+    {
+        bytes[i] = value >> (8 * i);
+    }
+    out_write(out, (char *)bytes, size);
+}
+
+
+/* вид изменения в выводе изменений (--delta) */
+enum change
+{
+    CHANGE_NONE,     /* обычная запись полного списка */
+    CHANGE_ADDED,
+    CHANGE_REMOVED,
+    CHANGE_CHANGED   /* тот же путь и тип, другие mode, uid, gid или mtime */
+};
+
+const char *change_names[] = { "", "added", "removed", "changed" };
+const char change_signs[] = " +-~";
+
+int snapshot_delta = 0;  /* --delta: при повторном обходе выводим только изменения */
+
+#define BINARY_DELTA_MAGIC "FMDELTA\n"
+
+
+/* двоичная запись, все числа little-endian:
+u32 длина остатка записи, [u32 вид изменения - только в выводе изменений,]
+u32 mode, u32 uid, u32 gid, i64 mtime в наносекундах, i64 atime в наносекундах,
+путь (без нуля в конце) */
+void write_binary_record(struct out_buf *out, const struct file_info *file,
+                         const char *dir, size_t dir_length, size_t name_length, enum change change)
+{
+    size_t path_length = dir_length + 1 + name_length;
+    out_le(out, 28 + (change != CHANGE_NONE ? 4 : 0) + path_length, 4);
+    if (change != CHANGE_NONE)  out_le(out, change, 4);
+    out_le(out, file->mode, 4);
+    out_le(out, file->uid, 4);
+    out_le(out, file->gid, 4);
+    out_le(out, time_ns(&file->mtim), 8);
+    out_le(out, time_ns(&file->atim), 8);
+    out_write(out, dir, dir_length);
+    out_write(out, "/", 1);
+    out_write(out, file->real_name, name_length);
+}
+
+
+/* запись об объекте file из каталога dir (dir_length байт) в машинном формате.
+Изменение (change != CHANGE_NONE) пишется и в текстовом формате: знак + - ~ и
+путь, экранированный out_text_bytes */
+void write_record(struct out_buf *out, const struct file_info *file, const char *dir, size_t dir_length,
+                  enum change change)
+{
+    size_t name_length = strlen(file->real_name);
+    switch (dump_format)
+    {
+        case FORMAT_TEXT:
+            if (change == CHANGE_NONE)  break;
+            out_write(out, &change_signs[change], 1);
+            out_write(out, " ", 1);
+            out_text_bytes(out, dir, dir_length);
+            out_write(out, "/", 1);
+            out_text_bytes(out, file->real_name, name_length);
+            out_write(out, "\n", 1);
+            break;
+
+        case FORMAT_NDJSON:
+            out_write(out, "{", 1);
+            if (change != CHANGE_NONE)
+            {
+                out_puts(out, "\"change\":\"");
+                out_puts(out, change_names[change]);
+                out_puts(out, "\",");
+            }
+            out_puts(out, "\"path\":\"");
+            out_json_bytes(out, dir, dir_length);
+            out_write(out, "/", 1);
+            out_json_bytes(out, file->real_name, name_length);
+            out_puts(out, "\",\"mode\":");
+            out_decimal(out, file->mode);
+            out_puts(out, ",\"uid\":");
+            out_decimal(out, file->uid);
+            out_puts(out, ",\"gid\":");
+            out_decimal(out, file->gid);
+            out_puts(out, ",\"mtime_ns\":");
+            out_decimal(out, time_ns(&file->mtim));
+            out_puts(out, ",\"atime_ns\":");
+            out_decimal(out, time_ns(&file->atim));
+            out_puts(out, "}\n");
+            break;
+
+        case FORMAT_CSV:
+            if (change != CHANGE_NONE)
+            {
+                out_puts(out, change_names[change]);
+                out_write(out, ",", 1);
+            }
+            if (csv_needs_quotes(dir, dir_length) || csv_needs_quotes(file->real_name, name_length))
+            {
+                /* путь - одно поле в кавычках, длина не ограничена */
+                out_write(out, "\"", 1);
+                out_csv_bytes(out, dir, dir_length);
+                out_write(out, "/", 1);
+                out_csv_bytes(out, file->real_name, name_length);
+                out_write(out, "\"", 1);
+            }
+            else
+            {
+                out_write(out, dir, dir_length);
+                out_write(out, "/", 1);
+                out_write(out, file->real_name, name_length);
+            }
+            out_write(out, ",", 1);
+            out_decimal(out, file->mode);
+            out_write(out, ",", 1);
+            out_decimal(out, file->uid);
+            out_write(out, ",", 1);
+            out_decimal(out, file->gid);
+            out_write(out, ",", 1);
+            out_decimal(out, time_ns(&file->mtim));
+            out_write(out, ",", 1);
+            out_decimal(out, time_ns(&file->atim));
+            out_write(out, "\r\n", 2);
+            break;
+
+        case FORMAT_BINARY:
+            write_binary_record(out, file, dir, dir_length, name_length, change);
+            break;
+    }
+}
+
+
+/* начало вывода: заголовок CSV или сигнатура двоичного формата */
+void write_format_header(struct out_buf *out)
+{
+    if (dump_format == FORMAT_CSV && snapshot_delta)  out_puts(out, "change,");
+    if (dump_format == FORMAT_CSV)     out_puts(out, "path,mode,uid,gid,mtime_ns,atime_ns\r\n");
+    if (dump_format == FORMAT_BINARY)  out_write(out, snapshot_delta ? BINARY_DELTA_MAGIC : BINARY_MAGIC, 8);
+}
+
+
+/* заголовок каталога перед его содержимым, путь обрезается до PATH_MAX - 1.
+Перед корнем пустой строки нет; в машинных форматах заголовков нет */
+void print_dir_header(struct out_buf *out, const char *dir_path, size_t length, int root)
+{
+    if (dump_format != FORMAT_TEXT)  return;
+    if (length > PATH_MAX - 1)  length = PATH_MAX - 1;
+    if (!root)  out_write(out, "\n", 1);
+    out_write(out, "'", 1);
+    out_write(out, dir_path, length);
+    out_write(out, "':\n", 3);
+}
+
+
+/* обход для вывода в файл без рекурсии: уровень хранит имена подкаталогов
+(сверх бюджета памяти - одно, и перечитывает каталог) и держит не больше
+DUMP_MAX_FDS дескрипторов, закрытый открывается заново от предка */
+
+#define DUMP_MAX_FDS 64
+
+size_t dump_memory_limit = 64u << 20;  /* бюджет на имена подкаталогов или, с -j, на невыведенные буферы; задаётся --memory */
+
+struct inode_set dump_visited;  /* каталоги, уже попавшие в вывод */
+dev_t dump_root_dev;            /* файловая система корня для SCAN_ONE_FS */
+
+
+/* решаем, обходить ли открытый каталог dir_fd, заголовок которого уже выведен.
+0 - обходить; иначе каталог пропускается: он на другой файловой системе
+(при SCAN_ONE_FS выводится только заголовок) или уже был в выводе */
+int dump_skip_directory(int dir_fd, struct inode_set *visited, pthread_mutex_t *lock)
+{
+    struct stat st;
+    if (fstat(dir_fd, &st) == -1)  return 0;
+
+    if ((scan_flags & SCAN_ONE_FS) && st.st_dev != dump_root_dev)  return 1;
+
+    if (lock != NULL)  pthread_mutex_lock(lock);
+    int inserted = inode_set_insert(visited, st.st_dev, st.st_ino);
+    if (lock != NULL)  pthread_mutex_unlock(lock);
+    if (inserted == 0)
+    {
+        scan_error(L"Каталог уже выведен.");
+        return 1;
+    }
+    return 0;
+}
+
+struct dump_level
+{
+    int fd;              /* -1 - закрыт ради лимита дескрипторов */
+    size_t path_length;  /* длина пути каталога в dump_path */
+    size_t names;        /* имена подкаталогов уровня в dump_names: [names, end) */
+    size_t next;         /* следующее имя */
+    size_t end;
+    int spilled;         /* в dump_names одно имя: следующее или, если visited, уже обойдённое */
+    int visited;
+};
+
+struct dump_stack
+{
+    struct dump_level *levels;
+    unsigned int depth;
+    unsigned int capacity;
+    unsigned int open_fds;
+    unsigned int max_fds;
+    unsigned int first_open;  /* самый мелкий уровень (кроме корня), у которого может быть дескриптор */
+    struct out_buf names;
+    struct out_buf path;
+};
+
+
+/* открываем каталог по именам path[start, end), разделённым '/', от каталога dir_fd.
+Сам dir_fd остаётся открытым; -1 - не удалось */
+int open_components(int dir_fd, const char *path, size_t start, size_t end)
+{
+    int fd = dir_fd;
+    while (start < end)
+    {
+        char name[NAME_MAX + 1];
+        const char *slash = memchr(path + start, '/', end - start);
+        size_t length = (slash != NULL ? (size_t)(slash - path) : end) - start;
+        if (length > NAME_MAX)  length = NAME_MAX;
+        memcpy(name, path + start, length);
+        name[length] = 0;
+        start += length + 1;
+
+        int child = openat(fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        stats_add(STAT_OPEN, 1);
+        if (fd != dir_fd)  close(fd);
+        if (child == -1)  return -1;
+        fd = child;
+    }
+    return fd;
+}
+
+
+/* открываем заново каталог уровня index по именам от ближайшего открытого предка */
+int dump_reopen(struct dump_stack *stack, unsigned int index)
+{
+    unsigned int open = index;
+    while (stack->levels[open].fd == -1)  open--;  /* корень не закрывается */
+
+    int fd = open_components(stack->levels[open].fd, stack->path.data,
+                             stack->levels[open].path_length + 1, stack->levels[index].path_length);
+    if (fd == -1)  return -1;
+
+    stack->levels[index].fd = fd;
+    stack->open_fds++;
+    if (index < stack->first_open)  stack->first_open = index;
+    return 0;
+}
+
+
+/* освобождаем дескриптор самого мелкого открытого уровня, кроме корня и текущего */
+void dump_close_shallowest(struct dump_stack *stack)
+{
+    while (stack->first_open < stack->depth - 1 && stack->levels[stack->first_open].fd == -1)
+    {
+        stack->first_open++;
+    }
+    if (stack->first_open >= stack->depth - 1)  return;
+
+    close(stack->levels[stack->first_open].fd);
+    stack->levels[stack->first_open].fd = -1;
+    stack->open_fds--;
+    stack->first_open++;
+}
+
+
+/* перечитываем каталог уровня и ищем первый подкаталог после обойдённого name
+(каталоги между собой сортируются по strcmp). 1 - нашли, имя записано в name */
+int dump_rescan_next(int dir_fd, char *name)
+{
+    scan_quiet = 1;  /* об ошибках уже сообщили при первом чтении */
+
+    unsigned int base = dump_arena.used;
+    int count = scan_directory(dir_fd, &dump_arena, SCAN_TYPE_ONLY | (scan_flags & SCAN_STATX_BATCH));
+
+    const char *best = NULL;
+    for (int i = 0; i < count; i++)
+    {
+        struct file_info *file = &dump_arena.data[base + i];
+        if (S_ISDIR(file->mode) && strcmp(file->real_name, name) > 0
+            && (best == NULL || strcmp(file->real_name, best) < 0))
+        {
+            best = file->real_name;
+        }
+    }
+    if (best != NULL)  strcpy(name, best);
+
+    arena_release(&dump_arena, base);
+    scan_quiet = 0;
+    return best != NULL;
+}
+
+
+/* выводим файлы каталога dir_fd и кладём на стек уровень с его подкаталогами.
+Путь каталога уже лежит в конце stack->path */
+void dump_push_level(struct dump_stack *stack, int dir_fd, unsigned int columns[])
+{
+    unsigned int base = dump_arena.used;
+
+    int count = scan_directory(dir_fd, &dump_arena, scan_flags);
+    if (count < 0)
+    {
+        arena_release(&dump_arena, base);
+        close(dir_fd);
+        return;
+    }
+
+    struct file_info *local_files = dump_arena.data + base;
+    unsigned int *local_order = NULL;
+    if (sort(local_files, count, &local_order, SORT_NAME) != 0)
+    {
+        scan_error(L"Не удалось выделить память для сортировки.");
+        free(local_order);
+        arena_release(&dump_arena, base);
+        close(dir_fd);
+        return;
+    }
+
+    struct file_row row;
+    size_t names_size = 0;
+    unsigned int first_dir = count;
+    for (int i = 0; i < count; i++)
+    {
+        struct file_info *file = &local_files[local_order[i]];
+        if (dump_format != FORMAT_TEXT)
+        {
+            write_record(&dump_out, file, stack->path.data, stack->path.used, CHANGE_NONE);
+        }
+        else if (!S_ISDIR(file->mode))
+        {
+            format_row(file, &row);
+            display_data_in_file(&dump_out, &row, columns);
+        }
+        if (S_ISDIR(file->mode))
+        {
+            if (first_dir == (unsigned int)count)  first_dir = i;
+            names_size += strlen(file->real_name) + 1;
+        }
+    }
+
+    if (first_dir == (unsigned int)count)
+    {
+        /* подкаталогов нет - уровень не нужен */
+        free(local_order);
+        arena_release(&dump_arena, base);
+        close(dir_fd);
+        return;
+    }
+
+    if (stack->depth == stack->capacity)
+    {
+        unsigned int capacity = stack->capacity ? stack->capacity * 2 : 16;
+        struct dump_level *tmp = realloc(stack->levels, capacity * sizeof(struct dump_level));
+        if (tmp == NULL)
+        {
+            scan_error(L"Не удалось выделить память для обхода.");
+            free(local_order);
+            arena_release(&dump_arena, base);
+            close(dir_fd);
+            return;
+        }
+        stack->levels = tmp;
+        stack->capacity = capacity;
+    }
+
+    struct dump_level *level = &stack->levels[stack->depth];
+    level->fd = dir_fd;
+    level->path_length = stack->path.used;
+    level->names = stack->names.used;
+    level->spilled = (stack->names.used + names_size > dump_memory_limit);
+    level->visited = 0;
+
+    /* имена подкаталогов в порядке вывода; не влезают - только первое */
+    for (int i = first_dir; i < count; i++)
+    {
+        struct file_info *file = &local_files[local_order[i]];
+        if (!S_ISDIR(file->mode))  continue;
+
+        size_t size = level->spilled ? NAME_MAX + 1 : strlen(file->real_name) + 1;
+        if (out_reserve(&stack->names, size) != 0)
+        {
+            scan_error(L"Не удалось выделить память для обхода.");
+            stack->names.used = level->names;
+            free(local_order);
+            arena_release(&dump_arena, base);
+            close(dir_fd);
+            return;
+        }
+        strcpy(stack->names.data + stack->names.used, file->real_name);
+        stack->names.used += size;
+        if (level->spilled)  break;
+    }
+    level->next = level->names;
+    level->end = stack->names.used;
+
+    free(local_order);
+    arena_release(&dump_arena, base);
+
+    stack->depth++;
+    stack->open_fds++;
+    if (stack->open_fds > stack->max_fds)  dump_close_shallowest(stack);
+}
+
+
+/* то же с событием каталога в трассе */
+void dump_push_directory(struct dump_stack *stack, int dir_fd, unsigned int columns[])
+{
+    unsigned long long traced = trace_begin();
+    dump_push_level(stack, dir_fd, columns);
+    trace_end("directory", traced, "%.*s", (int)stack->path.used, stack->path.data);
+}
+
+
+/* имя следующего подкаталога верхнего уровня, NULL - уровень обойдён */
+const char *dump_next_name(struct dump_stack *stack)
+{
+    struct dump_level *level = &stack->levels[stack->depth - 1];
+
+    if (!level->spilled)
+    {
+        if (level->next == level->end)  return NULL;
+        const char *name = stack->names.data + level->next;
+        level->next += strlen(name) + 1;
+        return name;
+    }
+
+    char *name = stack->names.data + level->names;
+    if (level->visited && !dump_rescan_next(level->fd, name))  return NULL;
+    level->visited = 1;
+    return name;
+}
+
+
+void display_files_iterative(int dir_fd, char *root_path, unsigned int columns[])
+{
+    struct dump_stack stack = { .names = { .fd = -1 }, .path = { .fd = -1 }, .first_open = 1 };
+
+    stack.max_fds = DUMP_MAX_FDS;
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur / 4 < stack.max_fds)
+    {
+        stack.max_fds = limit.rlim_cur / 4 > 2 ? limit.rlim_cur / 4 : 2;
+    }
+
+    struct stat st;
+    if (fstat(dir_fd, &st) == 0)
+    {
+        dump_root_dev = st.st_dev;
+        inode_set_insert(&dump_visited, st.st_dev, st.st_ino);
+    }
+
+    out_puts(&stack.path, root_path);
+    dump_push_directory(&stack, dir_fd, columns);
+
+    while (stack.depth > 0)
+    {
+        unsigned int top = stack.depth - 1;
+        struct dump_level *level = &stack.levels[top];
+
+        /* закрытый уровень открываем, только если в нём ещё есть подкаталоги */
+        int pending = level->spilled || level->next != level->end;
+        if (pending && level->fd == -1 && dump_reopen(&stack, top) != 0)
+        {
+            scan_error(L"Не удалось открыть директорию.");
+            level->next = level->end;
+            level->spilled = 0;
+        }
+
+        const char *name = dump_next_name(&stack);
+        if (name == NULL)
+        {
+            /* уровень обойдён: от него ничего не остаётся */
+            if (level->fd != -1)
+            {
+                close(level->fd);
+                stack.open_fds--;
+            }
+            stack.names.used = level->names;
+            stack.path.used = level->path_length;
+            stack.depth--;
+            continue;
+        }
+
+        stack.path.used = level->path_length;
+        out_write(&stack.path, "/", 1);
+        out_puts(&stack.path, name);
+        print_dir_header(&dump_out, stack.path.data, stack.path.used, 0);
+
+        int subdir_fd = openat(level->fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        stats_add(STAT_OPEN, 1);
+        if (subdir_fd == -1)
+        {
+            scan_error(L"Не удалось открыть директорию.");
+            continue;
+        }
+        if (dump_skip_directory(subdir_fd, &dump_visited, NULL))
+        {
+            close(subdir_fd);
+            continue;
+        }
+        dump_push_directory(&stack, subdir_fd, columns);
+    }
+
+    free(stack.levels);
+    out_free(&stack.names);
+    out_free(&stack.path);
+    inode_set_free(&dump_visited);
+}
+
+
+
+/* параллельный обход для вывода в файл: каталог - задача в очереди потока
+(work stealing), буферы выводятся в порядке display_files_iterative.
+Память буферов - не больше dump_memory_limit, дескрипторов - не больше DUMP_MAX_FDS */
+int dump_threads = 1;
+
+struct dump_node
+{
+    struct dump_node *parent;
+    char *path;
+    size_t path_length;
+    char *name;                      /* для openat относительно родителя */
+    unsigned int index;              /* место среди подкаталогов родителя */
+    int fd;                          /* удерживается, пока не открылись все подкаталоги; -1 - нет */
+    unsigned int unopened;           /* подкаталоги, ещё не открывшие свой каталог */
+    unsigned int refs;               /* вывод, очередь и живые подкаталоги: им нужна цепочка предков */
+    dev_t dev;                       /* каталог для проверки повторов, если has_id */
+    ino_t ino;
+    int has_id;
+    int silent;                      /* повтор или его потомок: вывод пропускается */
+    int claimed;                     /* задачу уже взял поток или вывод */
+    struct out_buf block;            /* заголовок, сообщения и строки файлов каталога */
+    size_t header_length;            /* заголовок в начале block */
+    struct dump_node **children;     /* подкаталоги в порядке вывода, живут вместе с узлом */
+    unsigned int child_count;
+    int done;                        /* block и children готовы, защищено pool.lock */
+};
+
+/* очередь задач потока: владелец работает с хвостом, воры - с головой */
+struct dump_deque
+{
+    pthread_mutex_t lock;
+    struct dump_node **tasks;
+    unsigned int head;
+    unsigned int tail;
+    unsigned int capacity;
+};
+
+struct dump_pool
+{
+    struct dump_deque *deques;
+    int threads;
+    unsigned int *columns;
+    unsigned long queued;    /* задач во всех очередях */
+    int sleeping;            /* потоков, ждущих работу */
+    int stop;
+    unsigned int open_fds;   /* удерживаемые дескрипторы каталогов */
+    unsigned int max_fds;
+    size_t buffered;         /* память готовых, но не выведенных буферов */
+    pthread_mutex_t lock;
+    pthread_cond_t work;     /* появились задачи или пора завершаться */
+    pthread_cond_t ready;    /* какой-то узел готов к выводу */
+    pthread_cond_t drained;  /* вывод освободил буферы */
+};
+
+struct dump_pool pool;
+
+pthread_mutex_t dump_visited_lock = PTHREAD_MUTEX_INITIALIZER;  /* dump_visited при обходе потоками */
+
+struct dump_worker
+{
+    int id;
+    pthread_t thread;
+    struct file_arena arena;
+    unsigned int *order;
+};
+
+
+int deque_push(struct dump_deque *deque, struct dump_node *node)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail == deque->capacity)
+    {
+        /* сначала сдвигаем к началу то, что осталось после краж */
+        if (deque->head > 0)
+        {
+            memmove(deque->tasks, deque->tasks + deque->head,
+                    (deque->tail - deque->head) * sizeof(struct dump_node *));
+            deque->tail -= deque->head;
+            deque->head = 0;
+        }
+        if (deque->tail == deque->capacity)
+        {
+            unsigned int capacity = deque->capacity ? deque->capacity * 2 : 64;
+            struct dump_node **tmp = realloc(deque->tasks, capacity * sizeof(struct dump_node *));
+            if (tmp == NULL)
+            {
+                pthread_mutex_unlock(&deque->lock);
+                return -1;
+            }
+            deque->tasks = tmp;
+            deque->capacity = capacity;
+        }
+    }
+    deque->tasks[deque->tail++] = node;
+    pthread_mutex_unlock(&deque->lock);
+
+    __atomic_add_fetch(&pool.queued, 1, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+
+struct dump_node *deque_pop(struct dump_deque *deque, int steal)
+{
+    struct dump_node *node = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->head < deque->tail)
+    {
+        node = steal ? deque->tasks[deque->head++] : deque->tasks[--deque->tail];
+        if (deque->head == deque->tail)  deque->head = deque->tail = 0;
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    if (node != NULL)  __atomic_sub_fetch(&pool.queued, 1, __ATOMIC_SEQ_CST);
+    return node;
+}
+
+
+/* освобождённый узел отпускает и своего родителя */
+void dump_node_unref(struct dump_node *node)
+{
+    while (node != NULL && __atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        struct dump_node *parent = node->parent;
+        free(node->children);
+        free(node->name);
+        free(node->path);
+        free(node);
+        node = parent;
+    }
+}
+
+
+/* открываем каталог узла. Удержанный дескриптор родителя жив, пока узел
+не отметился в его unopened. Иначе идём по пути: целиком, если он короче
+PATH_MAX, или от ближайшего предка с таким путём по именам */
+int dump_open_node(struct dump_node *node)
+{
+    int fd = node->parent->fd;
+    if (fd != -1)
+    {
+        stats_add(STAT_OPEN, 1);
+        return openat(fd, node->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+
+    unsigned int steps = 0;
+    struct dump_node *anchor = node;
+    while (anchor->path_length >= PATH_MAX && anchor->parent != NULL)
+    {
+        anchor = anchor->parent;
+        steps++;
+    }
+
+    struct dump_node **chain = malloc((steps > 0 ? steps : 1) * sizeof(struct dump_node *));
+    if (chain == NULL)  return -1;
+    struct dump_node *step = node;
+    for (unsigned int i = steps; i > 0; i--)
+    {
+        chain[i - 1] = step;
+        step = step->parent;
+    }
+
+    fd = open(anchor->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    stats_add(STAT_OPEN, 1);
+    for (unsigned int i = 0; i < steps && fd != -1; i++)
+    {
+        int child = openat(fd, chain[i]->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        stats_add(STAT_OPEN, 1);
+        close(fd);
+        fd = child;
+    }
+    free(chain);
+    return fd;
+}
+
+
+/* нужно ли читать каталог открытого узла: цикл - по цепочке предков,
+повтор - по уже выведенным; окончательно о повторе решает вывод */
+
+int dump_node_wanted(struct dump_node *node)
+{
+    struct stat st;
+    if (fstat(node->fd, &st) == -1)  return 1;
+
+    if ((scan_flags & SCAN_ONE_FS) && st.st_dev != dump_root_dev)  return 0;
+
+    node->dev = st.st_dev;
+    node->ino = st.st_ino;
+    node->has_id = 1;
+
+    for (struct dump_node *ancestor = node->parent; ancestor != NULL; ancestor = ancestor->parent)
+    {
+        if (ancestor->has_id && ancestor->dev == node->dev && ancestor->ino == node->ino)  return 0;
+    }
+
+    pthread_mutex_lock(&dump_visited_lock);
+    int seen = inode_set_contains(&dump_visited, node->dev, node->ino);
+    pthread_mutex_unlock(&dump_visited_lock);
+    return !seen;
+}
+
+
+/* задача: открыть каталог, прочитать, отформатировать, поставить подкаталоги */
+void dump_run(struct dump_worker *worker, struct dump_node *node)
+{
+    unsigned long long traced = trace_begin();
+    struct out_buf *out = &node->block;
+    out->fd = -1;
+    struct out_buf *saved_out = scan_out;  /* у вывода, выполняющего задачу сам, это dump_out */
+    scan_out = out;
+
+    struct dump_node *parent = node->parent;
+    if (parent != NULL)
+    {
+        print_dir_header(out, node->path, node->path_length, 0);
+        node->header_length = out->used;
+
+        node->fd = dump_open_node(node);
+
+        /* последний открывшийся подкаталог закрывает удержанный каталог родителя */
+        if (__atomic_sub_fetch(&parent->unopened, 1, __ATOMIC_ACQ_REL) == 0 && parent->fd != -1)
+        {
+            close(parent->fd);
+            parent->fd = -1;
+            __atomic_sub_fetch(&pool.open_fds, 1, __ATOMIC_RELAXED);
+        }
+
+        if (node->fd == -1)  scan_error(L"Не удалось открыть директорию.");
+    }
+
+    if (node->fd != -1 && !dump_node_wanted(node))
+    {
+        close(node->fd);
+        node->fd = -1;
+    }
+
+    int count = -1;
+    if (node->fd != -1)
+    {
+        arena_release(&worker->arena, 0);
+        count = scan_directory(node->fd, &worker->arena, scan_flags);
+    }
+
+    if (count >= 0 && sort(worker->arena.data, count, &worker->order, SORT_NAME) != 0)
+    {
+        scan_error(L"Не удалось выделить память для сортировки.");
+        count = -1;
+    }
+
+    unsigned int dirs = 0;
+    struct file_row row;
+    for (int i = 0; i < count; i++)
+    {
+        struct file_info *file = &worker->arena.data[worker->order[i]];
+        if (dump_format != FORMAT_TEXT)
+        {
+            write_record(out, file, node->path, node->path_length, CHANGE_NONE);
+        }
+        else if (!S_ISDIR(file->mode))
+        {
+            format_row(file, &row);
+            display_data_in_file(out, &row, pool.columns);
+        }
+        if (S_ISDIR(file->mode))
+        {
+            dirs++;
+        }
+    }
+
+    /* подкаталоги: сначала создаём все узлы, потом ставим их в очередь.
+    Путь не ограничен PATH_MAX, как и у последовательного обхода */
+    if (dirs > 0)  node->children = malloc(dirs * sizeof(struct dump_node *));
+    if (dirs > 0 && node->children == NULL)  scan_error(L"Не удалось выделить память для обхода.");
+    for (int i = 0; i < count && node->children != NULL; i++)
+    {
+        struct file_info *file = &worker->arena.data[worker->order[i]];
+        if (!S_ISDIR(file->mode))  continue;
+
+        size_t name_length = strlen(file->real_name);
+        struct dump_node *child = calloc(1, sizeof(struct dump_node));
+        if (child != NULL)
+        {
+            child->path = malloc(node->path_length + name_length + 2);
+            child->name = strdup(file->real_name);
+        }
+        if (child == NULL || child->path == NULL || child->name == NULL)
+        {
+            if (child != NULL)
+            {
+                free(child->path);
+                free(child->name);
+            }
+            free(child);
+            scan_error(L"Не удалось выделить память для обхода.");
+            break;
+        }
+        memcpy(child->path, node->path, node->path_length);
+        child->path[node->path_length] = '/';
+        memcpy(child->path + node->path_length + 1, file->real_name, name_length + 1);
+        child->path_length = node->path_length + 1 + name_length;
+        child->parent = node;
+        child->index = node->child_count;
+        child->fd = -1;
+        child->refs = 2;
+        node->children[node->child_count++] = child;
+    }
+
+    scan_out = saved_out;
+    trace_end("directory", traced, "%s", node->path);
+
+    node->unopened = node->child_count;
+    __atomic_add_fetch(&node->refs, node->child_count, __ATOMIC_ACQ_REL);
+
+    /* дескриптор нужен подкаталогам; сверх лимита они откроются по пути */
+    if (node->fd != -1 && (node->child_count == 0
+        || __atomic_add_fetch(&pool.open_fds, 1, __ATOMIC_RELAXED) > pool.max_fds))
+    {
+        if (node->child_count > 0)  __atomic_sub_fetch(&pool.open_fds, 1, __ATOMIC_RELAXED);
+        close(node->fd);
+        node->fd = -1;
+    }
+
+    /* в обратном порядке, чтобы первым из своей очереди взять первый подкаталог */
+    for (int i = (int)node->child_count - 1; i >= 0; i--)
+    {
+        if (deque_push(&pool.deques[worker->id], node->children[i]) != 0)
+        {
+            /* без памяти под очередь выполняем задачу сразу */
+            node->children[i]->claimed = 1;
+            dump_run(worker, node->children[i]);
+            dump_node_unref(node->children[i]);
+        }
+    }
+
+    __atomic_add_fetch(&pool.buffered, out->capacity, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&pool.lock);
+    node->done = 1;
+    if (pool.sleeping > 0 && node->child_count > 0)  pthread_cond_broadcast(&pool.work);
+    pthread_cond_broadcast(&pool.ready);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+
+void *dump_worker_main(void *arg)
+{
+    struct dump_worker *worker = arg;
+
+    char name[16];
+    snprintf(name, sizeof(name), "dump %d", worker->id);
+    trace_thread_name(name);
+
+    while (1)
+    {
+        /* вывод отстал: ждём, пока он освободит буферы */
+        if (__atomic_load_n(&pool.buffered, __ATOMIC_RELAXED) > dump_memory_limit)
+        {
+            pthread_mutex_lock(&pool.lock);
+            while (!pool.stop && __atomic_load_n(&pool.buffered, __ATOMIC_RELAXED) > dump_memory_limit)
+            {
+                pthread_cond_wait(&pool.drained, &pool.lock);
+            }
+            pthread_mutex_unlock(&pool.lock);
+        }
+
+        struct dump_node *node = deque_pop(&pool.deques[worker->id], 0);
+
+        /* своя очередь пуста - ищем задачу у соседей */
+        for (int i = 1; node == NULL && i < pool.threads; i++)
+        {
+            node = deque_pop(&pool.deques[(worker->id + i) % pool.threads], 1);
+        }
+
+        if (node != NULL)
+        {
+            /* задачу мог уже выполнить вывод */
+            if (!__atomic_exchange_n(&node->claimed, 1, __ATOMIC_ACQ_REL))  dump_run(worker, node);
+            dump_node_unref(node);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool.lock);
+        if (pool.stop)
+        {
+            pthread_mutex_unlock(&pool.lock);
+            break;
+        }
+        if (__atomic_load_n(&pool.queued, __ATOMIC_SEQ_CST) == 0)
+        {
+            pool.sleeping++;
+            pthread_cond_wait(&pool.work, &pool.lock);
+            pool.sleeping--;
+        }
+        pthread_mutex_unlock(&pool.lock);
+    }
+
+    uring_free(&stat_ring);
+    trace_thread_end();
+    return NULL;
+}
+
+
+/* ждём узел, который выводить следующим; если его ещё никто не взял, выполняем сами */
+void dump_wait(struct dump_worker *emitter, struct dump_node *node)
+{
+    pthread_mutex_lock(&pool.lock);
+    while (!node->done)
+    {
+        if (!__atomic_exchange_n(&node->claimed, 1, __ATOMIC_ACQ_REL))
+        {
+            pthread_mutex_unlock(&pool.lock);
+            dump_run(emitter, node);
+            pthread_mutex_lock(&pool.lock);
+            continue;
+        }
+        pthread_cond_wait(&pool.ready, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+
+/* параллельный аналог display_files_iterative: вывод тот же, порядок тот же.
+dir_fd закрывается внутри */
+int display_files_parallel(int dir_fd, char *root_path, unsigned int columns[], int threads)
+{
+    struct dump_worker *workers = calloc(threads + 1, sizeof(struct dump_worker));
+    pool.deques = calloc(threads, sizeof(struct dump_deque));
+    struct dump_node *root = calloc(1, sizeof(struct dump_node));
+    if (workers == NULL || pool.deques == NULL || root == NULL || (root->path = strdup(root_path)) == NULL)
+    {
+        free(workers);
+        free(pool.deques);
+        free(root);
+        close(dir_fd);
+        return -1;
+    }
+
+    pool.threads = threads;
+    pool.columns = columns;
+    pool.queued = 0;
+    pool.sleeping = 0;
+    pool.stop = 0;
+    pool.open_fds = 0;
+    pool.buffered = 0;
+    pool.max_fds = DUMP_MAX_FDS;
+    int spawn = threads;
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+    {
+        if (limit.rlim_cur / 4 < pool.max_fds)  pool.max_fds = limit.rlim_cur / 4 > 2 ? limit.rlim_cur / 4 : 2;
+        /* каждый поток держит ещё до трёх дескрипторов: каталог, его
+        подкаталог при открытии по пути и кольцо io_uring */
+        if (limit.rlim_cur / 8 < (rlim_t)spawn)  spawn = limit.rlim_cur / 8;
+    }
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.work, NULL);
+    pthread_cond_init(&pool.ready, NULL);
+    pthread_cond_init(&pool.drained, NULL);
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_mutex_init(&pool.deques[i].lock, NULL);
+    }
+
+    struct stat st;
+    if (fstat(dir_fd, &st) == 0)  dump_root_dev = st.st_dev;
+
+    root->path_length = strlen(root->path);
+    root->fd = dir_fd;
+    root->refs = 2;
+    deque_push(&pool.deques[0], root);
+
+    int started = 0;
+    for (; started < spawn; started++)
+    {
+        workers[started].id = started;
+        if (pthread_create(&workers[started].thread, NULL, dump_worker_main, &workers[started]) != 0)  break;
+    }
+
+    /* вывод в порядке обхода в глубину по дереву узлов. Если ни один поток
+    не запустился, вывод выполняет все задачи сам, то есть последовательно */
+    struct dump_worker *emitter = &workers[threads];
+    struct dump_node *node = root;
+    while (node != NULL)
+    {
+        dump_wait(emitter, node);
+
+        /* повтор каталога решаем здесь, в порядке вывода: выводится первое вхождение */
+        int duplicate = 0;
+        if (!node->silent && node->has_id)
+        {
+            pthread_mutex_lock(&dump_visited_lock);
+            duplicate = (inode_set_insert(&dump_visited, node->dev, node->ino) == 0);
+            pthread_mutex_unlock(&dump_visited_lock);
+        }
+
+        if (duplicate)
+        {
+            out_write(&dump_out, node->block.data, node->header_length);
+            scan_error(L"Каталог уже выведен.");
+        }
+        else if (!node->silent)
+        {
+            out_write(&dump_out, node->block.data, node->block.used);
+        }
+
+        size_t released = node->block.capacity;
+        out_free(&node->block);
+        pthread_mutex_lock(&pool.lock);
+        size_t buffered = __atomic_sub_fetch(&pool.buffered, released, __ATOMIC_RELAXED);
+        if (buffered <= dump_memory_limit && buffered + released > dump_memory_limit)
+        {
+            pthread_cond_broadcast(&pool.drained);
+        }
+        pthread_mutex_unlock(&pool.lock);
+
+        if (duplicate || node->silent)
+        {
+            /* потомки повтора тоже не выводятся */
+            for (unsigned int i = 0; i < node->child_count; i++)  node->children[i]->silent = 1;
+        }
+
+        /* дальше - первый подкаталог, иначе следующий подкаталог родителя
+        или ближайшего предка. Предки живы, пока жив узел */
+        struct dump_node *next = (node->child_count > 0) ? node->children[0] : NULL;
+        for (struct dump_node *up = node; next == NULL && up->parent != NULL; up = up->parent)
+        {
+            if (up->index + 1 < up->parent->child_count)  next = up->parent->children[up->index + 1];
+        }
+        dump_node_unref(node);
+        node = next;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.stop = 1;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+    for (int i = 0; i <= threads; i++)
+    {
+        arena_free(&workers[i].arena);
+        free(workers[i].order);
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        /* уже выполненные задачи, до которых не дошли потоки */
+        struct dump_node *left;
+        while ((left = deque_pop(&pool.deques[i], 0)) != NULL)  dump_node_unref(left);
+        pthread_mutex_destroy(&pool.deques[i].lock);
+        free(pool.deques[i].tasks);
+    }
+
+    free(workers);
+    free(pool.deques);
+    pool.deques = NULL;
+    inode_set_free(&dump_visited);
+    return 0;
+}
+
+
+/* сохранение снимка (-S) и повторный обход (-i): каталог с теми же (ino, mtime, ctime),
+что в предыдущем снимке, не читается, его дети берутся из снимка */
+
+/* уровень обхода: подкаталоги уровня - узлы [first, first + dirs),
+их имена лежат подряд в names. Подкаталоги открываются openat от fd уровня,
+дескрипторы держатся так же, как у dump_stack */
+struct snapshot_level
+{
+    int fd;            /* -1 - закрыт ради лимита дескрипторов */
+    size_t path_length;
+    size_t names;      /* имя следующего подкаталога в names */
+    unsigned int first;
+    unsigned int dirs;
+    unsigned int next;
+    unsigned int old;  /* каталог уровня в предыдущем снимке, если has_old */
+    int has_old;
+};
+
+struct snapshot_writer
+{
+    int fd;                       /* -1 - снимок не сохраняем */
+    int emit;                     /* выводим полный список или изменения в dump_out */
+    const struct snapshot *old;   /* предыдущий снимок, NULL - обход без него */
+    struct out_buf pool;          /* пул имён, копится во временном файле */
+    unsigned long long pool_size;
+    unsigned int node_count;
+    struct snapshot_node *block;  /* узлы одного каталога перед записью */
+    unsigned int block_capacity;
+    struct out_buf names;         /* стек имён подкаталогов */
+    struct snapshot_level *levels;
+    unsigned int depth;
+    unsigned int capacity;
+    unsigned int open_fds;
+    unsigned int max_fds;
+    unsigned int first_open;
+    struct inode_set visited;
+    dev_t root_dev;
+    struct out_buf path;          /* путь текущего каталога, только для вывода */
+};
+
+
+void snapshot_fill_node(struct snapshot_node *node, const struct file_info *file, unsigned int parent,
+                        unsigned long long name)
+{
+    memset(node, 0, sizeof(struct snapshot_node));
+    node->name = name;
+    node->parent = parent;
+    node->mode = file->mode;
+    node->uid = file->uid;
+    node->gid = file->gid;
+    node->mtime_ns = time_ns(&file->mtim);
+    node->atime_ns = time_ns(&file->atim);
+}
+
+
+int snapshot_pwrite(int fd, const void *data, size_t size, off_t offset)
+{
+    size_t written = 0;
+    while (written < size)
+    {
+        ssize_t n = pwrite(fd, (const char *)data + written, size - written, offset + written);
+        stats_add(STAT_WRITES, 1);
+        if (n == -1 && errno == EINTR)  continue;
+        if (n <= 0)  return -1;
+        written += n;
+    }
+    stats_add(STAT_BYTES, written);
+    return 0;
+}
+
+
+off_t snapshot_node_offset(unsigned int index)
+{
+    return sizeof(struct snapshot_header) + (off_t)index * sizeof(struct snapshot_node);
+}
+
+
+/* подкаталог name каталога parent в снимке, 0 - такого нет.
+Дети лежат в порядке SORT_NAME: каталоги первыми, между собой по strcmp */
+unsigned int snapshot_find_dir(const struct snapshot *snap, unsigned int parent, const char *name)
+{
+    unsigned int first;
+    unsigned int low = 0;
+    unsigned int high = snapshot_children(snap, parent, &first);
+    while (low < high)
+    {
+        unsigned int middle = low + (high - low) / 2;
+        const char *middle_name = snapshot_name(snap, first + middle);
+        if (middle_name == NULL)  return 0;
+
+        int order = S_ISDIR(snap->nodes[first + middle].mode) ? strcmp(middle_name, name) : 1;
+        if (order == 0)  return first + middle;
+        if (order < 0)   low = middle + 1;
+        else             high = middle;
+    }
+    return 0;
+}
+
+
+/* удалённый объект index и, если это каталог, всё его поддерево из снимка.
+Путь каталога объекта - в writer->path, на время спуска он удлиняется */
+void snapshot_emit_removed(struct snapshot_writer *writer, unsigned int index)
+{
+    struct file_info file;
+    snapshot_file_info(writer->old, index, &file);
+    size_t length = writer->path.used;
+    write_record(&dump_out, &file, writer->path.data, length, CHANGE_REMOVED);
+
+    unsigned int first;
+    unsigned int count = S_ISDIR(file.mode) ? snapshot_children(writer->old, index, &first) : 0;
+    if (count == 0)  return;
+
+    if (out_reserve(&writer->path, strlen(file.real_name) + 1) != 0)
+    {
+        scan_error(L"Не удалось выделить память для вывода изменений.");
+        return;
+    }
+
+    /* дети всегда лежат после родителя, так что спуск конечен */
+    out_write(&writer->path, "/", 1);
+    out_puts(&writer->path, file.real_name);
+    for (unsigned int i = 0; i < count; i++)
+    {
+        snapshot_emit_removed(writer, first + i);
+    }
+    writer->path.used = length;
+}
+
+
+/* изменения каталога: сравниваем его детей из снимка [old_first, old_first + old_count)
+с прочитанными (или взятыми из снимка с обновлёнными подкаталогами). Оба списка
+в порядке SORT_NAME, так что хватает одного прохода слиянием */
+void snapshot_emit_changes(struct snapshot_writer *writer, unsigned int old_first, unsigned int old_count,
+                           struct file_info *entries, unsigned int *order, unsigned int count)
+{
+    size_t dir_length = writer->path.used;  /* data может переехать, пока выводим удалённые поддеревья */
+    unsigned int i = 0;
+    unsigned int j = 0;
+    while (i < old_count || j < count)
+    {
+        struct file_info saved;
+        struct file_info *file = (j < count) ? &entries[order[j]] : NULL;
+        int difference = 1;  /* < 0 - объект только в снимке, > 0 - только на диске */
+        if (i < old_count)
+        {
+            snapshot_file_info(writer->old, old_first + i, &saved);
+            if (file == NULL)  difference = -1;
+            else if (S_ISDIR(saved.mode) != S_ISDIR(file->mode))  difference = S_ISDIR(saved.mode) ? -1 : 1;
+            else  difference = strcmp(saved.real_name, file->real_name);
+        }
+
+        if (difference < 0)
+        {
+            snapshot_emit_removed(writer, old_first + i++);
+        }
+        else if (difference > 0)
+        {
+            write_record(&dump_out, file, writer->path.data, dir_length, CHANGE_ADDED);
+            j++;
+        }
+        else
+        {
+            if (saved.mode != file->mode || saved.uid != file->uid || saved.gid != file->gid
+                || time_ns(&saved.mtim) != time_ns(&file->mtim))
+            {
+                write_record(&dump_out, file, writer->path.data, dir_length, CHANGE_CHANGED);
+            }
+            i++;
+            j++;
+        }
+    }
+}
+
+
+/* освобождаем дескриптор самого мелкого открытого уровня, кроме корня и текущего */
+void snapshot_close_shallowest(struct snapshot_writer *writer)
+{
+    while (writer->first_open < writer->depth - 1 && writer->levels[writer->first_open].fd == -1)
+    {
+        writer->first_open++;
+    }
+    if (writer->first_open >= writer->depth - 1)  return;
+
+    close(writer->levels[writer->first_open].fd);
+    writer->levels[writer->first_open].fd = -1;
+    writer->open_fds--;
+    writer->first_open++;
+}
+
+
+/* открываем заново каталог уровня index по именам от ближайшего открытого предка */
+int snapshot_reopen(struct snapshot_writer *writer, unsigned int index)
+{
+    unsigned int open = index;
+    while (writer->levels[open].fd == -1)  open--;  /* корень не закрывается */
+
+    int fd = open_components(writer->levels[open].fd, writer->path.data,
+                             writer->levels[open].path_length + 1, writer->levels[index].path_length);
+    if (fd == -1)  return -1;
+
+    writer->levels[index].fd = fd;
+    writer->open_fds++;
+    if (index < writer->first_open)  writer->first_open = index;
+    return 0;
+}
+
+
+/* каталог dir_fd - узел node (в предыдущем снимке - old): дети одним блоком в снимок
+и в вывод, подкаталоги - уровнем на стек вместе с dir_fd. -1 - ошибка записи */
+int snapshot_save_directory(struct snapshot_writer *writer, int dir_fd, unsigned int node, unsigned int old, int has_old)
+{
+    struct snapshot_dir state = { 0 };
+    struct stat st;
+    if (fstat(dir_fd, &st) == 0)
+    {
+        if ((scan_flags & SCAN_ONE_FS) && st.st_dev != writer->root_dev)
+        {
+            close(dir_fd);
+            return 0;
+        }
+        if (inode_set_insert(&writer->visited, st.st_dev, st.st_ino) == 0)
+        {
+            scan_error(L"Каталог уже выведен.");
+            close(dir_fd);
+            return 0;
+        }
+
+        state.ino = st.st_ino;
+        state.mtime_ns = time_ns(&st.st_mtim);
+        state.ctime_ns = time_ns(&st.st_ctim);
+
+        /* каталог, изменённый меньше секунды назад (то же окно, что у кэша списков),
+        мог измениться и после чтения, не сдвинув mtime: в следующий раз перечитываем */
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        if (time_ns(&now) - state.ctime_ns < LISTING_CACHE_RACY_NS)  state.mtime_ns = 0;
+    }
+
+    unsigned int old_first = 0;
+    unsigned int old_count = 0;
+    int reuse = 0;
+    if (has_old)
+    {
+        const struct snapshot_dir *saved = &writer->old->nodes[old].dir;
+        old_count = snapshot_children(writer->old, old, &old_first);
+        reuse = state.mtime_ns != 0 && saved->ino == state.ino && saved->mtime_ns == state.mtime_ns
+                && saved->ctime_ns == state.ctime_ns && saved->child_count == old_count;
+    }
+
+    int count;
+    unsigned int *local_order = NULL;
+    if (reuse)
+    {
+        stats_add(STAT_REUSED, 1);
+        local_order = malloc((old_count > 0 ? old_count : 1) * sizeof(unsigned int));
+        for (count = 0; local_order != NULL && (unsigned int)count < old_count; count++)
+        {
+            struct file_info *file = arena_reserve(&dump_arena);
+            if (file == NULL)  break;
+            snapshot_file_info(writer->old, old_first + count, file);
+
+            /* атрибуты подкаталога меняются, не трогая mtime родителя (в подкаталоге
+            создали файл), а открывать его всё равно придётся - обновляем */
+            if (S_ISDIR(file->mode))  stat_entry(dir_fd, file);
+            arena_commit(&dump_arena);
+            local_order[count] = count;  /* в снимке дети уже в порядке SORT_NAME */
+        }
+    }
+    else
+    {
+        count = scan_directory(dir_fd, &dump_arena, scan_flags);
+        if (count > 0 && sort(dump_arena.data, count, &local_order, SORT_NAME) != 0)
+        {
+            scan_error(L"Не удалось выделить память для сортировки.");
+            count = -1;
+        }
+    }
+    /* каталог, прочитанный не полностью, сохраняется пустым и в следующий раз
+    перечитывается, а его изменения не выводятся: иначе все дети стали бы удалёнными */
+    int failed = (count < 0);  /* о причине scan_directory уже сообщил */
+    if (!failed && ((reuse && (local_order == NULL || (unsigned int)count < old_count))
+                    || writer->node_count + (unsigned int)count < writer->node_count))
+    {
+        scan_error(L"Не удалось выделить память для снимка.");
+        failed = 1;
+    }
+    if (!failed && (unsigned int)count > writer->block_capacity)
+    {
+        struct snapshot_node *tmp = realloc(writer->block, count * sizeof(struct snapshot_node));
+        if (tmp == NULL)
+        {
+            scan_error(L"Не удалось выделить память для снимка.");
+            failed = 1;
+        }
+        else
+        {
+            writer->block = tmp;
+            writer->block_capacity = count;
+        }
+    }
+    if (failed || local_order == NULL)  count = 0;
+    if (failed)
+    {
+        state.mtime_ns = 0;
+        if (writer->emit && snapshot_delta)  scan_error(L"Изменения каталога не выведены.");
+    }
+
+    if (writer->emit && snapshot_delta && !failed)
+    {
+        snapshot_emit_changes(writer, old_first, old_count, dump_arena.data, local_order, count);
+    }
+
+    const char *dir = writer->path.data;
+    size_t dir_length = writer->path.used;
+    size_t names_start = writer->names.used;
+    unsigned int dirs = 0;
+    struct file_row row;
+    for (int i = 0; i < count; i++)
+    {
+        struct file_info *file = &dump_arena.data[local_order[i]];
+        size_t name_length = strlen(file->real_name) + 1;
+        if (writer->fd != -1)
+        {
+            snapshot_fill_node(&writer->block[i], file, node, writer->pool_size);
+            out_write(&writer->pool, file->real_name, name_length);
+            writer->pool_size += name_length;
+        }
+
+        if (writer->emit && !snapshot_delta)
+        {
+            if (dump_format != FORMAT_TEXT)
+            {
+                write_record(&dump_out, file, dir, dir_length, CHANGE_NONE);
+            }
+            else if (!S_ISDIR(file->mode))
+            {
+                format_row(file, &row);
+                display_data_in_file(&dump_out, &row, file_columns);
+            }
+        }
+
+        if (S_ISDIR(file->mode))
+        {
+            dirs++;
+            if (out_reserve(&writer->names, name_length) != 0)  failed = 1;
+            out_write(&writer->names, file->real_name, name_length);
+        }
+    }
+    free(local_order);
+    arena_release(&dump_arena, 0);
+
+    unsigned int first = writer->node_count;
+    writer->node_count += count;
+    state.first_child = first;
+    state.child_count = count;
+    if (writer->fd != -1
+        && ((count > 0 && snapshot_pwrite(writer->fd, writer->block, count * sizeof(struct snapshot_node),
+                                          snapshot_node_offset(first)) != 0)
+            || snapshot_pwrite(writer->fd, &state, sizeof(state),
+                               snapshot_node_offset(node) + offsetof(struct snapshot_node, dir)) != 0))
+    {
+        close(dir_fd);
+        return -1;
+    }
+
+    /* номер подкаталога - его место среди детей, без одного имени не спуститься ни в один */
+    if (failed && dirs > 0)
+    {
+        scan_error(L"Не удалось выделить память для снимка.");
+        writer->names.used = names_start;
+        dirs = 0;
+    }
+    if (dirs == 0)
+    {
+        close(dir_fd);
+        return 0;
+    }
+
+    if (writer->depth == writer->capacity)
+    {
+        unsigned int capacity = writer->capacity ? writer->capacity * 2 : 64;
+        struct snapshot_level *tmp = realloc(writer->levels, capacity * sizeof(struct snapshot_level));
+        if (tmp == NULL)
+        {
+            scan_error(L"Не удалось выделить память для снимка.");
+            writer->names.used = names_start;
+            close(dir_fd);
+            return 0;
+        }
+        writer->levels = tmp;
+        writer->capacity = capacity;
+    }
+
+    struct snapshot_level *level = &writer->levels[writer->depth++];
+    level->fd = dir_fd;
+    level->path_length = dir_length;
+    level->names = names_start;
+    level->first = first;
+    level->dirs = dirs;
+    level->next = 0;
+    level->old = old;
+    level->has_old = has_old;
+    writer->open_fds++;
+    if (writer->open_fds > writer->max_fds)  snapshot_close_shallowest(writer);
+    return 0;
+}
+
+
+/* обходим root_path, снимок - в file_path (NULL - не пишем) через .tmp и rename,
+так что им может быть и сам old. emit - выводить список или изменения */
+
+int snapshot_save(char *root_path, char *file_path, const struct snapshot *old, int emit)
+{
+    struct snapshot_writer writer = { .fd = -1, .emit = emit, .old = old, .pool = { .fd = -1 }, .names = { .fd = -1 },
+                                      .path = { .fd = -1 }, .first_open = 1 };
+    char temp_path[PATH_MAX];
+    FILE *pool_file = NULL;
+    if (file_path != NULL)
+    {
+        if (snprintf(temp_path, PATH_MAX, "%s.tmp", file_path) < PATH_MAX)
+        {
+            writer.fd = open(temp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        }
+        pool_file = tmpfile();
+        if (writer.fd == -1 || pool_file == NULL)
+        {
+            fwprintf(stderr, L"Не удалось создать файл снимка.\n");
+            if (writer.fd != -1)  close(writer.fd);
+            if (pool_file != NULL)  fclose(pool_file);
+            return -21;
+        }
+        writer.pool.fd = fileno(pool_file);
+    }
+
+    const char *old_root = (old != NULL) ? snapshot_name(old, 0) : NULL;
+    if (old != NULL && (old_root == NULL || strcmp(old_root, root_path) != 0))
     {
-        wprintf(L"\e[%d;1HНе удалось получить размер окна терминала.", rows);
-        fflush(stdout);
-        return -9;
+        fwprintf(stderr, L"Снимок снят в другом каталоге, обходим заново.\n");
+        writer.old = NULL;
     }
-    rows = ws.ws_row;
 
-    /* считаем столбцы для таблицы */
-	unsigned int columns[7];
-    count_columns_width(ws.ws_col, columns);
+    struct file_info root = { 0 };
+    struct stat st;
+    if (stat(root_path, &st) == 0)
+    {
+        root.mode = st.st_mode;
+        root.uid = st.st_uid;
+        root.gid = st.st_gid;
+        root.mtim = st.st_mtim;
+        root.atim = st.st_atim;
+        writer.root_dev = st.st_dev;
+    }
+    struct snapshot_node root_node;
+    snapshot_fill_node(&root_node, &root, 0, 0);
+    writer.pool_size = strlen(root_path) + 1;
+    writer.node_count = 1;
 
-    /* считаем строки для таблицы, чтобы заголовки остались сверху */
-    int height = ws.ws_row - 3;
-    if (height < 1)
+    int result = 0;
+    if (writer.fd != -1)
     {
-        height = 1;
+        out_write(&writer.pool, root_path, writer.pool_size);
+        result = snapshot_pwrite(writer.fd, &root_node, sizeof(root_node), snapshot_node_offset(0));
+    }
+    writer.max_fds = DUMP_MAX_FDS;
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur / 4 < writer.max_fds)
+    {
+        writer.max_fds = limit.rlim_cur / 4 > 2 ? limit.rlim_cur / 4 : 2;
     }
 
-    /* вывод заголовков */
-    print_path(path, ws);
+    out_puts(&writer.path, root_path);
+    int root_fd = open(root_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    stats_add(STAT_OPEN, 1);
+    if (root_fd == -1)
+    {
+        scan_error(L"Не удалось открыть директорию.");
+    }
+    else if (result == 0)
+    {
+        result = snapshot_save_directory(&writer, root_fd, 0, 0, writer.old != NULL);
+    }
+    else
+    {
+        close(root_fd);
+    }
 
-    for (int i = 0; i < 7; i++)
+    while (result == 0 && writer.depth > 0)
     {
-        if (i == active_column)
+        unsigned int top = writer.depth - 1;
+        struct snapshot_level *level = &writer.levels[top];
+        if (level->next == level->dirs)
         {
-            wprintf(L"\e[1;3;48;5;198m");
+            if (level->fd != -1)
+            {
+                close(level->fd);
+                writer.open_fds--;
+            }
+            writer.names.used = level->names;
+            writer.path.used = level->path_length;
+            writer.depth--;
+            continue;
         }
-        else
+
+        const char *name = writer.names.data + level->names;
+        level->names += strlen(name) + 1;
+        unsigned int node = level->first + level->next++;
+
+        writer.path.used = level->path_length;
+        if (out_reserve(&writer.path, strlen(name) + 1) != 0)
         {
-            wprintf(L"\e[3;38;5;198m");
+            scan_error(L"Не удалось выделить память для снимка.");
+            continue;
         }
-
-        char *column_name;
-        switch (i)
+        if (level->fd == -1 && snapshot_reopen(&writer, top) != 0)
         {
-            case 0: column_name = "name";         break;
-            case 1: column_name = "type";         break;
-            case 2: column_name = "owner";        break;
-            case 3: column_name = "group";        break;
-            case 4: column_name = "permissions";  break;
-            case 5: column_name = "mtime";        break;
-            case 6: column_name = "atime";        break;
+            scan_error(L"Не удалось открыть директорию.");
+            continue;
         }
+        out_write(&writer.path, "/", 1);
+        out_puts(&writer.path, name);
+        if (writer.emit && !snapshot_delta)  print_dir_header(&dump_out, writer.path.data, writer.path.used, 0);
 
-        print_string(column_name, columns[i], i);
+        int dir_fd = openat(level->fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        stats_add(STAT_OPEN, 1);
+        if (dir_fd == -1)
+        {
+            scan_error(L"Не удалось открыть директорию.");
+            continue;
+        }
 
-        wprintf(L"\e[0m");
-        if (i < 6) wprintf(L"|");
+        unsigned int old_node = level->has_old ? snapshot_find_dir(old, level->old, name) : 0;
+        result = snapshot_save_directory(&writer, dir_fd, node, old_node, old_node != 0);
     }
-    putwchar(L'\n');
 
-    /* вывод таблицы */
-    int data_end = height + scroll_pos;
-    if (data_end > file_counter)
+    /* после ошибки записи на стеке могли остаться открытые уровни */
+    while (writer.depth > 0)
     {
-        data_end = file_counter;
+        if (writer.levels[--writer.depth].fd != -1)  close(writer.levels[writer.depth].fd);
     }
-
-    for (int i = scroll_pos; i < data_end; i++)
+    out_free(&writer.path);
+    out_free(&writer.names);
+    free(writer.levels);
+    free(writer.block);
+    inode_set_free(&writer.visited);
+    if (writer.fd == -1)  return 0;
+
+    /* пул имён - за узлами, затем заголовок */
+    struct snapshot_header header = { .magic = SNAPSHOT_MAGIC };
+    header.node_size = sizeof(struct snapshot_node);
+    header.node_count = writer.node_count;
+    header.nodes_offset = snapshot_node_offset(0);
+    header.names_offset = snapshot_node_offset(writer.node_count);
+    header.names_size = writer.pool_size;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    header.created_ns = time_ns(&now);
+
+    if (result == 0 && out_flush(&writer.pool) != 0)  result = -1;
+    off_t pool_offset = 0;
+    if (result == 0 && lseek(writer.fd, header.names_offset, SEEK_SET) == -1)  result = -1;
+    while (result == 0 && (unsigned long long)pool_offset < writer.pool_size)
     {
-        if (i == cursor_pos)
-        {
-            wprintf(L"\e[1;48;5;212m");
-        }
-        display_data(files[i], columns, ws);
-        if (i == cursor_pos)
-        {
-            wprintf(L"\e[0m");
-        }
+        ssize_t n = sendfile(writer.fd, writer.pool.fd, &pool_offset, writer.pool_size - pool_offset);
+        if (n == -1 && errno == EINTR)  continue;
+        if (n <= 0)  result = -1;
     }
+    if (result == 0)  result = snapshot_pwrite(writer.fd, &header, sizeof(header), 0);
+
+    writer.pool.fd = -1;
+    out_free(&writer.pool);
+    fclose(pool_file);
+    if (close(writer.fd) != 0)  result = -1;
+    if (result == 0 && rename(temp_path, file_path) != 0)  result = -1;
 
+    if (result != 0)
+    {
+        unlink(temp_path);
+        fwprintf(stderr, L"Не удалось записать снимок.\n");
+        return -21;
+    }
     return 0;
 }
 
 
-void winsize_changed(int signum)
+/* fm_bench подключает этот файл целиком и запускает функции сам */
+#ifndef FM_NO_MAIN
+/* полная статистика в stderr после вывода в файл */
+void stats_report()
 {
-    display_in_terminal(path);
+    double total_ms = (monotonic_ns() - stats.start_ns) / 1e6;
+    unsigned long nss_hits = owner_cache.hits + group_cache.hits;
+
+    fwprintf(stderr, L"Каталогов: %llu, объектов: %llu, открытий каталогов: %llu, из снимка: %llu\n",
+             stats_counter(STAT_DIRS), stats_counter(STAT_ENTRIES), stats_counter(STAT_OPEN), stats_counter(STAT_REUSED));
+    fwprintf(stderr, L"readdir: %llu вызовов, %.1f мс\n", stats_counter(STAT_READDIR), phase_ms(PHASE_READDIR));
+    fwprintf(stderr, L"stat: %llu fstatat, %llu statx, %.1f мс\n",
+             stats_counter(STAT_STAT), stats_counter(STAT_STATX), phase_ms(PHASE_STAT));
+    fwprintf(stderr, L"NSS: %llu запросов, %lu из кэша, %.1f мс\n", stats_counter(STAT_NSS), nss_hits, phase_ms(PHASE_NSS));
+    fwprintf(stderr, L"Сортировка: %.1f мс\n", phase_ms(PHASE_SORT));
+    fwprintf(stderr, L"Форматирование (вместе с NSS): %.1f мс\n", phase_ms(PHASE_FORMAT));
+    fwprintf(stderr, L"Вывод: %llu write, %llu байт, %.1f мс\n",
+             stats_counter(STAT_WRITES), stats_counter(STAT_BYTES), phase_ms(PHASE_OUTPUT));
+    fwprintf(stderr, L"Всего: %.1f мс, пик памяти: %ld КБ, пик арен списков: %zu КБ\n", total_ms, peak_rss_kb(),
+             (arena_peak_bytes(&listing_arena) + arena_peak_bytes(&dump_arena)) / 1024);
 }
 
 
-int keyboard_input()
+int main(int argc, char *argv[])
 {
-    char input;
-    int read_bytes = read(0, &input, 1);  /* stdin = 0 */
+    setlocale(LC_ALL, "");
+    utf8_locale = (strcmp(nl_langinfo(CODESET), "UTF-8") == 0);
 
-    if (read_bytes == 1)
+    /* разбираем параметры командной строки */
+    struct option long_options[] =
     {
-        switch (input)
+        {"uring", no_argument, NULL, 'u'},
+        {"threads", required_argument, NULL, 'j'},
+        {"cache", required_argument, NULL, 'c'},
+        {"memory", required_argument, NULL, 'm'},
+        {"dereference", no_argument, NULL, 'L'},
+        {"one-file-system", no_argument, NULL, 'x'},
+        {"stats", no_argument, NULL, 's'},
+        {"trace", required_argument, NULL, 't'},
+        {"format", required_argument, NULL, 'f'},
+        {"save", required_argument, NULL, 'S'},
+        {"open", required_argument, NULL, 'o'},
+        {"since", required_argument, NULL, 'i'},
+        {"delta", no_argument, NULL, 'd'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "uj:c:m:Lxst:f:S:o:i:d", long_options, NULL)) != -1)
+    {
+        switch (opt)
         {
-            default:  return 0;
-            case 'q': return -1; /* выход из программы */
-            case 'Q': return -1;
-            case 4:   return -1; /* 4 - ctrl + d */
+            case 'u':  /* stat пакетами через io_uring */
+                scan_flags |= SCAN_STATX_BATCH;
+                break;
 
-            /* промотка пути */
-            case '<':
-                path_scroll--;
-                if (path_scroll < 0)
+            case 'j':  /* число потоков для вывода в файл */
+                dump_threads = atoi(optarg);
+                if (dump_threads < 1)
                 {
-                    path_scroll = 0;
+                    fwprintf(stderr, L"Число потоков должно быть положительным.\n");
+                    return -20;
                 }
-                return 1;
-
-            case '>':
-                path_scroll++;
-                return 1;
+                break;
 
-            /* переключение активного столбца */
-            case '[':
-                if (active_column > 0)
+            case 'c':  /* потолок памяти кэша списков в мегабайтах, 0 - без кэша */
+            {
+                char *end;
+                long megabytes = strtol(optarg, &end, 10);
+                if (*end != 0 || megabytes < 0)
                 {
-                    active_column--;
-                    return 1;
+                    fwprintf(stderr, L"Размер кэша должен быть неотрицательным числом мегабайт.\n");
+                    return -20;
                 }
+                listing_cache_limit = (size_t)megabytes << 20;
                 break;
+            }
 
-            case ']':
-                if (active_column < 6)
+            case 'm':  /* бюджет памяти на имена подкаталогов (с -j - на невыведенные буферы) при выводе в файл */
+            {
+                char *end;
+                long megabytes = strtol(optarg, &end, 10);
+                if (*end != 0 || megabytes < 0)
                 {
-                    active_column++;
-                    return 1;
+                    fwprintf(stderr, L"Бюджет памяти должен быть неотрицательным числом мегабайт.\n");
+                    return -20;
                 }
+                dump_memory_limit = (size_t)megabytes << 20;
                 break;
+            }
 
-            /* переход на родительский каталог */
-            case '^':
-                if (chdir("..") == 0)
-                {
-                    if (getcwd(path, PATH_MAX) == NULL)
-                    {
-                        wprintf(L"\e[%d;1HНе удалось получить путь к рабочему каталогу.", rows);
-                        fflush(stdout);
-                        return 0;
-                    }
-
-                    free(files);
-                    files = NULL;
-
-                    file_counter = get_files(path, &files);
-                    if (file_counter < 0)
-                    {
-                        file_counter = 0;
-                        wprintf(L"\e[%d;1HНе удалось получить файлы в директории.", rows);
-                        fflush(stdout);
-                        return 0;
-                    }
+            case 'L':  /* ссылки показываются и обходятся как их цели */
+                scan_flags |= SCAN_FOLLOW_LINKS;
+                break;
 
-                    cursor_pos = 0;
-                    active_column = 0;
-                    scroll_pos = 0;
-                    path_scroll = 0;
-                    for (int i = 0; i < 7; i++)
-                    {
-                        column_scrolls[i] = 0;
-                    }
+            case 'x':  /* вывод в файл не выходит за файловую систему рабочего каталога */
+                scan_flags |= SCAN_ONE_FS;
+                break;
 
-                    return 1;
-                }
+            case 's':  /* счётчики и время по фазам: в нижней строке или в stderr */
+                stats_enabled = 1;
+                stats_reset();
                 break;
 
-            /* переход в выбранный каталог */
-            case '\n':
-                if (file_counter > 0 && strcmp(files[cursor_pos].type, "directory") == 0)
+            case 't':  /* трасса событий в формате Chrome trace */
+            {
+                /* файл пишется при выходе, а терминал к тому времени сменит
+                рабочий каталог: относительный путь разрешаем сейчас */
+                char cwd[PATH_MAX];
+                if (optarg[0] == '/')
                 {
-                    char full_path[PATH_MAX];
-                    snprintf(full_path, PATH_MAX, "%s/%s", path, files[cursor_pos].real_name);
-
-                    if (chdir(full_path) == 0)
-                    {
-                        if (getcwd(path, PATH_MAX) == NULL)
-                        {
-                            wprintf(L"\e[%d;1HНе удалось получить путь к рабочему каталогу.", rows);
-                            fflush(stdout);
-                            return 0;
-                        }
-
-                        free(files);
-                        files = NULL;
-
-                        file_counter = get_files(path, &files);
-                        if (file_counter < 0)
-                        {
-                            file_counter = 0;
-                            wprintf(L"\e[%d;1HНе удалось получить файлы в директории.", rows);
-                            fflush(stdout);
-                            return 0;
-                        }
-
-                        cursor_pos = 0;
-                        active_column = 0;
-                        scroll_pos = 0;
-                        path_scroll = 0;
-                        for (int i = 0; i < 7; i++)
-                        {
-                            column_scrolls[i] = 0;
-                        }
-
-                        return 1;
-                    }
-                    else
-                    {
-                        wprintf(L"\e[%d;1HНет доступа к директории.", rows);
-                        fflush(stdout);
-                        return 0;
-                    }
+                    trace_path = strdup(optarg);
+                }
+                else if (getcwd(cwd, sizeof(cwd)) != NULL)
+                {
+                    trace_path = malloc(strlen(cwd) + strlen(optarg) + 2);
+                    if (trace_path != NULL)  sprintf(trace_path, "%s/%s", cwd, optarg);
                 }
+                if (trace_path == NULL)
+                {
+                    fwprintf(stderr, L"Не удалось получить путь к файлу трассы.\n");
+                    return -23;
+                }
+                trace_start_ns = monotonic_ns();
+                trace_thread_name("main");
                 break;
+            }
 
-            case 27:  /* 27 - стрелки */
-                char esc[2];
-                if (read(0, &esc[0], 1) == 1 && read(0, &esc[1], 1) == 1)
+            case 'f':  /* формат вывода в файл */
+                if (strcmp(optarg, "text") == 0)         dump_format = FORMAT_TEXT;
+                else if (strcmp(optarg, "ndjson") == 0)  dump_format = FORMAT_NDJSON;
+                else if (strcmp(optarg, "csv") == 0)     dump_format = FORMAT_CSV;
+                else if (strcmp(optarg, "binary") == 0)  dump_format = FORMAT_BINARY;
+                else
                 {
-                    if (esc[0] == '[')
-                    {
-                        switch (esc[1])
-                        {
-                            default:  return 0;
-                            case 'A':  /* стрелка вверх */
-                                if (cursor_pos > 0)
-                                {
-                                    cursor_pos--;
-                                    if (cursor_pos < scroll_pos)
-                                    {
-                                        scroll_pos = cursor_pos;
-                                    }
-                                    return 1;  /* перерисовка */
-                                }
-                                break;
-
-                            case 'B':  /* стрелка вниз */
-                                if (cursor_pos < (file_counter - 1))
-                                {
-                                    cursor_pos++;
-
-                                    struct winsize ws;
-                                    rows = ws.ws_row;
-                                    if (ioctl(1, TIOCGWINSZ, &ws) != -1)
-                                    {
-                                        int height = ws.ws_row - 3;
-                                        if (height < 1)
-                                        {
-                                            height = 1;
-                                        }
-                                        if (cursor_pos >= scroll_pos + height)
-                                        {
-                                            scroll_pos = cursor_pos - height + 1;
-                                        }
-                                    }
-                                    return 1;
-                                }
-                                break;
-
-                            /* промотка активного столбца */
-                            case 'C':  /* стрелка вправо */
-                                column_scrolls[active_column]++;
-                                return 1;
-
-                            case 'D':  /* стрелка влево */
-                                column_scrolls[active_column]--;
-                                if (column_scrolls[active_column] < 0)
-                                    column_scrolls[active_column] = 0;
-                                return 1;
-                        }
-                    }
+                    fwprintf(stderr, L"Формат вывода: text, ndjson, csv или binary.\n");
+                    return -20;
                 }
-        }
-    }
+                break;
 
-    return 0;
-}
+            case 'S':  /* сохранить снимок дерева и выйти */
+                snapshot_save_path = optarg;
+                break;
 
+            case 'o':  /* просматривать снимок вместо файловой системы */
+                snapshot_open_path = optarg;
+                break;
 
-void display_data_in_file(struct file_info file, unsigned int columns[])
-{
-    char *file_ptr;
-    wchar_t wc_file_ptr[NAME_MAX];
-    for (unsigned int i = 0; i < 7; i++)
-    {
-        switch (i)
-        {
-            case 0: file_ptr = file.name;         break;
-            case 1: file_ptr = file.type;         break;
-            case 2: file_ptr = file.uid;          break;
-            case 3: file_ptr = file.gid;          break;
-            case 4: file_ptr = file.permissions;  break;
-            case 5: file_ptr = file.mtime;        break;
-            case 6: file_ptr = file.atime;        break;
-        }
+            case 'i':  /* повторный обход: неизменившиеся каталоги берём из снимка */
+                snapshot_since_path = optarg;
+                break;
 
-        mbstowcs(wc_file_ptr, file_ptr, NAME_MAX);
-        wprintf(L"%-*ls", columns[i], wc_file_ptr);
+            case 'd':  /* при повторном обходе - только изменения */
+                snapshot_delta = 1;
+                break;
 
-        if (i < 6) wprintf(L"|");
+            default:
+                fwprintf(stderr, L"Использование: %s [-u|--uring] [-j N|--threads=N] [-c MB|--cache=MB] [-m MB|--memory=MB] [-L|--dereference] [-x|--one-file-system] [-s|--stats] [-t FILE|--trace=FILE] [-f FORMAT|--format=FORMAT] [-S FILE|--save=FILE] [-o FILE|--open=FILE] [-i FILE|--since=FILE] [-d|--delta]\n", argv[0]);
+                return -20;
+        }
     }
-    putwchar(L'\n');
-}
 
+    if (snapshot_delta && snapshot_since_path == NULL)
+    {
+        fwprintf(stderr, L"Изменения (--delta) выводятся только при повторном обходе (-i).\n");
+        return -20;
+    }
 
-/* рекурсивная функция для вывода в файл */
-void display_files_recursive(char *current_path, unsigned int columns[])
-{
-    struct file_info *local_files = NULL;
-    int local_file_count = 0;
+    /* SIGWINCH блокируем до запуска потоков, чтобы маску унаследовали все;
+    главный цикл получает его через signalfd */
+    sigset_t winch;
+    sigemptyset(&winch);
+    sigaddset(&winch, SIGWINCH);
+    if (pthread_sigmask(SIG_BLOCK, &winch, NULL) != 0)
+    {
+        wprintf(L"\e[%d;1HНе удалось заблокировать сигнал SIGWINCH.", rows);
+        fflush(stdout);
+        return -10;
+    }
 
-    DIR *dir = opendir(current_path);
-    if (dir == NULL)
+    /* находим путь к рабочей директории */
+    if (getcwd(path, PATH_MAX) == NULL)
     {
-        wprintf(L"\e[%d;1HНе удалось открыть директорию.", rows);
+        wprintf(L"\e[%d;1HНе удалось получить путь рабочей директории.", rows);
         fflush(stdout);
-        return;
+        return -11;
     }
 
-    struct dirent *rd;
-    while (1)
+    /* сохраняем снимок дерева или обходим заново относительно прошлого и выходим.
+    Повторный обход выводит полный список или только изменения (--delta) */
+    if (snapshot_save_path != NULL || snapshot_since_path != NULL)
     {
-        rd = readdir(dir);
-        if (rd == NULL)
+        if (snapshot_since_path != NULL && snapshot_open(&previous, snapshot_since_path) != 0)
         {
-            if (errno != 0)
-            {
-                wprintf(L"\e[%d;1HНе удалось получить rd.", rows);
-                fflush(stdout);
-                closedir(dir);
-                return;
-            }
-            break;
+            fwprintf(stderr, L"Не удалось открыть снимок.\n");
+            return -22;
         }
 
-        /* пропускаем "." и ".." */
-        if (strcmp(rd->d_name, ".") == 0 || strcmp(rd->d_name, "..") == 0)
-        {
-            continue;
-        }
+        if (dump_threads > 1)  fwprintf(stderr, L"Снимок снимается в один поток, -j не действует.\n");
 
-        struct file_info *tmp = realloc(local_files, (local_file_count + 1) * sizeof(struct file_info));
-        if (tmp == NULL)
+        int emit = (snapshot_since_path != NULL);
+        if (emit && !snapshot_delta)  print_dir_header(&dump_out, path, strlen(path), 1);
+        if (emit)  write_format_header(&dump_out);
+
+        int result = snapshot_save(path, snapshot_save_path, previous.data != NULL ? &previous : NULL, emit);
+        if (out_flush(&dump_out) != 0)
         {
-            wprintf(L"\e[%d;1HНе удалось выделить память для tmp.", rows);
-            fflush(stdout);
-            closedir(dir);
-            free(local_files);
-            return;
+            fwprintf(stderr, L"Не удалось записать вывод.\n");
+            result = -24;
         }
-        local_files = tmp;
-
-        struct file_info *current_file = local_files + local_file_count;
-
-        get_name(rd, current_file->name);
-        strcpy(current_file->real_name, rd->d_name);
-
-        char full_path[PATH_MAX];
-        snprintf(full_path, PATH_MAX, "%s/%s", current_path, rd->d_name);
-
-        struct stat st;
-        if (stat(full_path, &st) == -1)
+        if (stats_enabled)  stats_report();
+        if (trace_path != NULL && trace_write() != 0)
         {
-            wprintf(L"\e[%d;1HНе удалось получить stat.", rows);
-            fflush(stdout);
-            continue;
+            fwprintf(stderr, L"Не удалось записать трассу.\n");
         }
+        snapshot_close(&previous);
+        out_free(&dump_out);
+        arena_free(&dump_arena);
+        id_cache_free(&owner_cache);
+        id_cache_free(&group_cache);
+        uring_free(&stat_ring);
+        return result;
+    }
 
-        get_type(st, current_file->type);
-
-        if (get_owner(st, current_file->uid) != 0)
+    if (snapshot_open_path != NULL)
+    {
+        if (isatty(1) == 0)
         {
-            wprintf(L"\e[%d;1HНе удалось получить имя владельца.", rows);
-            fflush(stdout);
-            continue;
+            fwprintf(stderr, L"Снимок можно просматривать только в терминале.\n");
+            return -22;
         }
-
-        if (get_group(st, current_file->gid) != 0)
+        if (snapshot_open(&snapshot, snapshot_open_path) != 0 || snapshot_path(&snapshot, 0, path) != 0)
         {
-            wprintf(L"\e[%d;1HНе удалось получить имя группы.", rows);
-            fflush(stdout);
-            continue;
+            fwprintf(stderr, L"Не удалось открыть снимок.\n");
+            return -22;
         }
+    }
 
-        get_permissions(st, current_file->permissions);
+    /* если записываем в файл */
+	if (isatty(1) == 0)
+    {
+        /* всё дальнейшее идёт через буфер вывода, сначала отдаём то, что уже в stdout */
+        fflush(stdout);
+        scan_out = &dump_out;
 
-        if (get_mtime(st, current_file->mtime) != 0)
-        {
-            wprintf(L"\e[%d;1HНе удалось получить время изменения.", rows);
-            fflush(stdout);
-            continue;
-        }
+        print_dir_header(&dump_out, path, strlen(path), 1);
+        write_format_header(&dump_out);
 
-        if (get_atime(st, current_file->atime) != 0)
+        int dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        stats_add(STAT_OPEN, 1);
+        if (dir_fd == -1)
         {
-            wprintf(L"\e[%d;1HНе удалось получить время доступа.", rows);
-            fflush(stdout);
-            continue;
+            scan_error(L"Не удалось открыть директорию.");
         }
-
-        local_file_count++;
-    }
-    closedir(dir);
-
-    /* сортируем файлы в текущей директории */
-    if (local_files != NULL && local_file_count > 0)
-    {
-        for (unsigned int i = 0; i < local_file_count; i++)
+        else if (dump_threads > 1)
         {
-            for (unsigned int j = 0; j < local_file_count - i - 1; j++)
+            /* каталог закроет пул, когда откроются все подкаталоги */
+            if (display_files_parallel(dir_fd, path, file_columns, dump_threads) != 0)
             {
-                if (compare(&local_files[j], &local_files[j + 1]) > 0)
-                {
-                    struct file_info tmp = local_files[j];
-                    local_files[j] = local_files[j + 1];
-                    local_files[j + 1] = tmp;
-                }
+                scan_error(L"Не удалось запустить потоки обхода.");
             }
         }
-    }
-
-    for (int i = 0; i < local_file_count; i++)
-    {
-        if (strcmp(local_files[i].type, "directory") != 0)
+        else
         {
-            display_data_in_file(local_files[i], columns);
+            /* каталог закроет обход */
+            display_files_iterative(dir_fd, path, file_columns);
         }
-    }
 
-    /* рекурсивно обрабатываем подкаталоги */
-    for (int i = 0; i < local_file_count; i++)
-    {
-        if (strcmp(local_files[i].type, "directory") == 0)
+        scan_out = NULL;
+        int result = 0;
+        if (out_flush(&dump_out) != 0)
         {
-            char subdir_path[PATH_MAX];
-            snprintf(subdir_path, PATH_MAX, "%s/%s", current_path, local_files[i].real_name);
-            wchar_t wc_subdir_path[PATH_MAX];
-            mbstowcs(wc_subdir_path, subdir_path, PATH_MAX);
-            wprintf(L"\n'%ls':\n", wc_subdir_path);
-            display_files_recursive(subdir_path, columns);
+            fwprintf(stderr, L"Не удалось записать вывод.\n");
+            result = -24;
         }
+        if (stats_enabled)  stats_report();
+        if (trace_path != NULL && trace_write() != 0)
+        {
+            fwprintf(stderr, L"Не удалось записать трассу.\n");
+        }
+        out_free(&dump_out);
+        arena_free(&dump_arena);
+        id_cache_free(&owner_cache);
+        id_cache_free(&group_cache);
+        uring_free(&stat_ring);
+
+        arena_free(&listing_arena);
+        free(order);
+		return result;
     }
 
-    free(local_files);
-}
-
-
-int main()
-{
-    setlocale(LC_ALL, "");
+    /* если выводим в терминал */
 
-    /* устанавливаем обработчик сигнала SIGWINCH */
-    struct sigaction sigact;
-    sigact.sa_handler = winsize_changed;
-    sigemptyset(&sigact.sa_mask);
-    sigact.sa_flags = SA_RESTART;
-    if (sigaction(SIGWINCH, &sigact, NULL) == -1)
+    /* переводим терминал в режим обработки ввода */
+    struct termios old, new;
+    if (tcgetattr(0, &old) == -1)
     {
-        wprintf(L"\e[%d;1HНе удалось выставить обработчик сигнала SIGWINCH.", rows);
+        wprintf(L"\e[%d;1HНе удалось получить настройки терминала.", rows);
         fflush(stdout);
-        return -10;
+        return -13;
     }
-
-    /* находим путь к рабочей директории */
-    if (getcwd(path, PATH_MAX) == NULL)
+    memcpy(&new, &old, sizeof(struct termios));
+    /* инвертируем биты, затем применяем маску к c_lflag через побитовое И */
+    new.c_lflag &= ~(ICANON | ECHO);
+    if (tcsetattr(0, TCSANOW, &new) == -1)
     {
-        wprintf(L"\e[%d;1HНе удалось получить путь рабочей директории.", rows);
+        wprintf(L"\e[%d;1HНе удалось вернуть настройки терминала.", rows);
         fflush(stdout);
-        return -11;
+        arena_free(&listing_arena);
+        free(order);
+        return -14;
     }
 
-    /* считаем кол-во файлов в директории */
-    file_counter = get_files(path, &files);
-    if (file_counter < 0)
+    /* канал, через который фоновые потоки будят главный цикл */
+    if (pipe2(wake_pipe, O_NONBLOCK | O_CLOEXEC) == -1)
     {
-        wprintf(L"\e[%d;1HНе удалось вернуть настройки терминала.", rows);
+        tcsetattr(0, TCSANOW, &old);
+        wprintf(L"\e[%d;1HНе удалось создать канал для главного цикла.", rows);
         fflush(stdout);
         return -12;
     }
 
-    /* если записываем в файл */
-	if (isatty(1) == 0)
+    signal_fd = signalfd(-1, &winch, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd == -1)
     {
-        wchar_t wc_path[PATH_MAX];
-        mbstowcs(wc_path, path, PATH_MAX);
-        wprintf(L"'%ls':\n", wc_path);
-
-        display_files_recursive(path, file_columns);
-
-        free(files);
-		return 0;
+        tcsetattr(0, TCSANOW, &old);
+        wprintf(L"\e[%d;1HНе удалось получить SIGWINCH через signalfd.", rows);
+        fflush(stdout);
+        return -10;
     }
 
-    /* если выводим в терминал */
+    /* без inotify просто не будет живого обновления; снимок не меняется */
+    if (snapshot.data == NULL)  watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
 
-    /* переводим терминал в режим обработки ввода */
-    struct termios old, new;
-    if (tcgetattr(0, &old) == -1)
-    {
-        wprintf(L"\e[%d;1HНе удалось получить настройки терминала.", rows);
-        fflush(stdout);
-        return -13;
-    }
-    memcpy(&new, &old, sizeof(struct termios));
-    /* инвертируем биты, затем применяем маску к c_lflag через побитовое И */
-    new.c_lflag &= ~(ICANON | ECHO);
-    if (tcsetattr(0, TCSANOW, &new) == -1)
+    /* начинаем загрузку текущего каталога */
+    pthread_mutex_lock(&listing_lock);
+    int load_result = start_loading(path);
+    pthread_mutex_unlock(&listing_lock);
+    if (load_result != 0)
     {
-        wprintf(L"\e[%d;1HНе удалось вернуть настройки терминала.", rows);
+        tcsetattr(0, TCSANOW, &old);
+        wprintf(L"\e[%d;1HНе удалось получить файлы в директории.", rows);
         fflush(stdout);
-        free(files);
-        return -14;
+        return -12;
     }
 
     /* первоначальное отображение */
-    if (display_in_terminal(path) != 0)
+    pthread_mutex_lock(&listing_lock);
+    int display_result = display_in_terminal(path);
+    pthread_mutex_unlock(&listing_lock);
+    if (display_result != 0)
     {
+        shutdown_loader();
         if (tcsetattr(0, TCSANOW, &old) == -1)
         {
             wprintf(L"\e[%d;1HНе удалось вернуть настройки терминала.", rows);
             fflush(stdout);
-            free(files);
+            arena_free(&listing_arena);
+            free(order);
             return -15;
         }
         wprintf(L"\e[%d;1HНе удалось вывести данные в терминал.", rows);
         fflush(stdout);
-        free(files);
+        arena_free(&listing_arena);
+        free(order);
         return -16;
     }
 
+    /* кадр рисуется не чаще FRAME_NS: события за это время копятся в одну перерисовку */
+    int redraw = 0;
+    struct timespec last_render;
+    clock_gettime(CLOCK_MONOTONIC, &last_render);
+
     while (1)
     {
+        /* ждём ввода, пробуждения от фоновых потоков, SIGWINCH или изменений в каталоге;
+        если изменения уже есть или кадр отложен, ждём не дольше, чем до их обработки */
+        struct pollfd fds[4] =
+        {
+            {.fd = 0, .events = POLLIN},            /* stdin = 0 */
+            {.fd = wake_pipe[0], .events = POLLIN},
+            {.fd = watch.fd, .events = POLLIN},
+            {.fd = signal_fd, .events = POLLIN},
+        };
+        pthread_mutex_lock(&listing_lock);
+        int timeout = watch_timeout();
+        pthread_mutex_unlock(&listing_lock);
+        if (redraw)
+        {
+            long left = FRAME_NS - elapsed_ns(&last_render);
+            int frame_timeout = left > 0 ? (int)((left + 999999) / 1000000) : 0;
+            if (timeout == -1 || frame_timeout < timeout)  timeout = frame_timeout;
+        }
+        if (poll(fds, 4, timeout) == -1 && errno != EINTR)  break;
+
+        if (fds[1].revents & POLLIN)
+        {
+            char drain[64];
+            while (read(wake_pipe[0], drain, sizeof(drain)) > 0);
+            redraw = 1;
+        }
+        if (fds[3].revents & POLLIN)
+        {
+            struct signalfd_siginfo info[4];
+            while (read(signal_fd, info, sizeof(info)) > 0);
+            invalidate_frame();
+            redraw = 1;
+        }
+        if (fds[2].revents & POLLIN)  watch_read_events();
+        if (watch_refresh(path))  redraw = 1;
+        if (du_refresh())  redraw = 1;
+
         /* обработка ввода в терминал */
-        int input_result = keyboard_input();
-        if (input_result == -1)  break;
-        else if (input_result == 1)
+        if (fds[0].revents & (POLLIN | POLLHUP))
+        {
+            int input_result = keyboard_input();
+            if (input_result == -1)  break;
+            else if (input_result == 1)  redraw = 1;
+        }
+
+        if (redraw && elapsed_ns(&last_render) >= FRAME_NS)
         {
-            if (display_in_terminal(path) != 0)
+            redraw = 0;
+            clock_gettime(CLOCK_MONOTONIC, &last_render);
+            pthread_mutex_lock(&listing_lock);
+            display_result = display_in_terminal(path);
+            pthread_mutex_unlock(&listing_lock);
+            if (display_result != 0)
             {
+                shutdown_loader();
                 if (tcsetattr(0, TCSANOW, &old) == -1)
                 {
                     wprintf(L"\e[%d;1HНе удалось вернуть настройки терминала.", rows);
                     fflush(stdout);
-                    free(files);
+                    arena_free(&listing_arena);
+                    free(order);
                     return -17;
                 }
                 wprintf(L"\e[%d;1HНе удалось вывести данные в терминал.", rows);
                 fflush(stdout);
-                free(files);
+                arena_free(&listing_arena);
+                free(order);
                 return -18;
             }
         }
     }
 
+    shutdown_loader();
+    watch_free();
+    close(signal_fd);
     wprintf(L"\e[2J\e[H");
     if (tcsetattr(0, TCSANOW, &old) == -1)
     {
         wprintf(L"\e[%d;1HНе удалось вернуть настройки терминала.", rows);
         fflush(stdout);
-        free(files);
+        arena_free(&listing_arena);
+        free(order);
         return -19;
     }
 
-    free(files);
+    if (trace_path != NULL && trace_write() != 0)
+    {
+        wprintf(L"Не удалось записать трассу.\n");
+    }
+
+    arena_free(&listing_arena);
+    free(order);
+    free(filter.matches);
+    snapshot_close(&snapshot);
+    id_cache_free(&owner_cache);
+    id_cache_free(&group_cache);
+    uring_free(&stat_ring);
     return 0;
 }
+#endif  /* FM_NO_MAIN */
@@ -0,0 +1,50 @@
+#!/bin/sh
+# -f ndjson, csv и binary должны перечислять те же пути, что и текстовый вывод:
+# подкаталоги из заголовков и файлы под ними
+# использование: tests/dump_formats.sh FM GEN_TREE
+set -e
+
+fm=$(realpath "$1")
+gen_tree=$(realpath "$2")
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+"$gen_tree" wide "$dir/wide" 5 3 > /dev/null
+
+# пути из текстового вывода: корень без записи, имя - первая колонка до '|'
+(cd "$dir/wide" && LC_ALL=C.UTF-8 "$fm") | awk '
+    /^'\''.*'\'':$/ { header = substr($0, 2, length($0) - 3); if (seen++) print header; next }
+    /\|/ { name = substr($0, 1, index($0, "|") - 1); sub(/ +$/, "", name); print header "/" name }
+' | sort > "$dir/text"
+
+status=0
+for args in "" "-j 4"
+do
+    (cd "$dir/wide" && LC_ALL=C.UTF-8 "$fm" -f ndjson $args) \
+        | sed 's/^{"path":"\([^"]*\)".*/\1/' | sort > "$dir/ndjson"
+    (cd "$dir/wide" && LC_ALL=C.UTF-8 "$fm" -f csv $args) \
+        | sed '1d; s/,.*//' | sort > "$dir/csv"
+    # запись: длина (4 байта LE), 28 байт атрибутов, путь; в начале 8 байт сигнатуры
+    (cd "$dir/wide" && LC_ALL=C.UTF-8 "$fm" -f binary $args) | od -An -v -tu1 | awk '
+        { for (i = 1; i <= NF; i++) byte[count++] = $i }
+        END {
+            for (p = 8; p < count; p += 4 + size) {
+                size = byte[p] + 256 * byte[p + 1] + 65536 * byte[p + 2] + 16777216 * byte[p + 3]
+                path = ""
+                for (i = p + 4 + 28; i < p + 4 + size; i++) path = path sprintf("%c", byte[i])
+                print path
+            }
+        }' | sort > "$dir/binary"
+
+    for format in ndjson csv binary
+    do
+        if [ -s "$dir/$format" ] && cmp -s "$dir/text" "$dir/$format"
+        then
+            echo "ok   -f $format $args"
+        else
+            echo "FAIL -f $format $args"
+            status=1
+        fi
+    done
+done
+exit $status
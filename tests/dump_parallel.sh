@@ -0,0 +1,31 @@
+#!/bin/sh
+# вывод в файл с -j должен совпадать с последовательным побайтно,
+# в том числе на дереве глубже PATH_MAX и при малом --memory
+# использование: tests/dump_parallel.sh FM GEN_TREE
+set -e
+
+fm=$(realpath "$1")
+gen_tree=$(realpath "$2")
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+"$gen_tree" deep "$dir/deep" 1200 4 > /dev/null
+"$gen_tree" wide "$dir/wide" 6 4 > /dev/null
+
+status=0
+for tree in deep wide
+do
+    (cd "$dir/$tree" && LC_ALL=C.UTF-8 "$fm" > "$dir/$tree.serial" 2>&1)
+    for args in "-j 4" "-j 4 -m 1" "-j 1"
+    do
+        (cd "$dir/$tree" && LC_ALL=C.UTF-8 "$fm" $args > "$dir/$tree.parallel" 2>&1)
+        if cmp -s "$dir/$tree.serial" "$dir/$tree.parallel"
+        then
+            echo "ok   $tree $args"
+        else
+            echo "FAIL $tree $args"
+            status=1
+        fi
+    done
+done
+exit $status
@@ -0,0 +1,82 @@
+#!/bin/sh
+# -S и -i: повторный обход неизменённого дерева даёт пустой --delta и тот же
+# вывод, что и обычный (кроме atime: его сдвигает само чтение каталогов), а
+# изменения выводятся целиком; в том числе на дереве с путями длиннее PATH_MAX
+# использование: tests/snapshot.sh FM GEN_TREE
+set -e
+
+fm=$(realpath "$1")
+gen_tree=$(realpath "$2")
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+"$gen_tree" wide "$dir/wide" 5 3 > /dev/null
+
+# 40 уровней по 200 символов: путь до leaf около 8 КБ
+long=$(printf '%0200d' 0)
+mkdir "$dir/long"
+(
+    cd "$dir/long"
+    i=0
+    while [ $i -lt 40 ]
+    do
+        mkdir "$long"
+        cd -P "$long"
+        i=$((i + 1))
+    done
+    touch leaf
+)
+
+status=0
+check()
+{
+    name=$1
+    shift
+    if "$@"
+    then
+        echo "ok   $name"
+    else
+        echo "FAIL $name"
+        status=1
+    fi
+}
+
+for tree in wide long
+do
+    cd "$dir/$tree"
+    LC_ALL=C.UTF-8 "$fm" -f ndjson | sed 's/,"atime_ns":[0-9]*//' > "$dir/$tree.dump"
+    LC_ALL=C.UTF-8 "$fm" -S "$dir/$tree.snap" 2> /dev/null
+
+    LC_ALL=C.UTF-8 "$fm" -i "$dir/$tree.snap" --delta > "$dir/$tree.delta" 2> /dev/null
+    check "$tree: --delta пуст" test ! -s "$dir/$tree.delta"
+
+    LC_ALL=C.UTF-8 "$fm" -i "$dir/$tree.snap" -f ndjson 2> /dev/null | sed 's/,"atime_ns":[0-9]*//' > "$dir/$tree.since"
+    check "$tree: -i как обычный вывод" cmp -s "$dir/$tree.dump" "$dir/$tree.since"
+done
+
+check "long: leaf в снимке" grep -q '/leaf"' "$dir/long.since"
+
+# удалённое поддерево перечисляется целиком
+cd "$dir/wide"
+removed=$(find dir_000/dir_001 | wc -l)
+rm -r dir_000/dir_001
+LC_ALL=C.UTF-8 "$fm" -i "$dir/wide.snap" --delta > "$dir/wide.delta" 2> /dev/null
+check "wide: удалённое поддерево" test "$(grep -c '^- ' "$dir/wide.delta")" = "$removed"
+
+# изменения глубже PATH_MAX выводятся с полными путями
+(
+    cd "$dir/long"
+    i=0
+    while [ $i -lt 40 ]
+    do
+        cd -P "$long"
+        i=$((i + 1))
+    done
+    rm leaf
+    touch leaf2
+)
+cd "$dir/long"
+LC_ALL=C.UTF-8 "$fm" -i "$dir/long.snap" --delta > "$dir/long.delta" 2> /dev/null
+check "long: удалённый файл" grep -q "^- $dir/long/\\($long/\\)\\{40\\}leaf\$" "$dir/long.delta"
+check "long: новый файл" grep -q "^+ $dir/long/\\($long/\\)\\{40\\}leaf2\$" "$dir/long.delta"
+exit $status